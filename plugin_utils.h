@@ -1,6 +1,8 @@
 #pragma once
 
+#include <cstdlib>
 #include <fstream>
+#include <optional>
 #include <string>
 #include <vector>
 
@@ -29,7 +31,8 @@ private:
   }
 
 public:
-  tee_ostream(raw_ostream &out, const std::optional<std::string> &path) : raw_ostream(true), out(out) {
+  // Buffered, reports are written in many small fragments.
+  tee_ostream(raw_ostream &out, const std::optional<std::string> &path) : out(out) {
     std::error_code EC;
     if (path) {
       file = std::make_unique<llvm::raw_fd_ostream>(*path, EC, llvm::sys::fs::OF_Text);
@@ -37,7 +40,9 @@ public:
         llvm::errs() << "Error: Unable to open file " << *path << ": " << EC.message() << "\n";
       }
     }
+    SetBufferSize(1 << 20);
   }
+  ~tee_ostream() override { flush(); }
 };
 
 // XXX Stolen from
@@ -85,9 +90,21 @@ inline std::optional<std::string> demangleCXXName(const char *abiName) {
     // -2: mangled_name is not a valid name under the C++ ABI mangling rules.
     // -3: One of the arguments is invalid.
     return {};
-  } else {
-    return ret;
   }
+  std::string name(ret);
+  std::free(ret);
+  return name;
+}
+
+// Plugins are loaded by clang or the linker after their own option parsing, so knobs are read from the environment instead of cl::opt.
+inline std::optional<std::string> getEnv(const char *name) {
+  if (const char *value = std::getenv(name); value && *value) return value;
+  return {};
+}
+
+inline uint64_t getEnvUnsigned(const char *name, uint64_t fallback) {
+  if (auto value = getEnv(name)) return std::strtoull(value->c_str(), nullptr, 10);
+  return fallback;
 }
 
 inline std::vector<std::string> getCmdLine() {
@@ -0,0 +1,75 @@
+// Loop kernels for measuring the overhead of the bounds-checking mode, see the `bench` target in the Makefile.
+// Prints one `<kernel> <ms>` line per kernel (best of several runs).
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+
+constexpr size_t N = 1 << 20, Dim = 512, MatDim = 192, Runs = 5;
+
+template <typename F> static void run(const char *name, F f) {
+  double best = 1e300, sink = 0;
+  for (size_t r = 0; r < Runs; ++r) {
+    const auto start = std::chrono::steady_clock::now();
+    sink += f();
+    best = std::min(best, std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count());
+  }
+  std::printf("%s %.3f\n", name, best);
+  std::fprintf(stderr, "# %s checksum %g\n", name, sink);
+}
+
+__attribute__((noinline)) static double triad(double *a, const double *b, const double *c, size_t n) {
+  for (size_t i = 0; i < n; ++i)
+    a[i] = b[i] + 3.0 * c[i];
+  return a[n / 2];
+}
+
+__attribute__((noinline)) static double stencil(double *out, const double *in, size_t dim) {
+  for (size_t y = 1; y < dim - 1; ++y)
+    for (size_t x = 1; x < dim - 1; ++x)
+      out[y * dim + x] =
+          0.2 * (in[y * dim + x] + in[(y - 1) * dim + x] + in[(y + 1) * dim + x] + in[y * dim + x - 1] + in[y * dim + x + 1]);
+  return out[dim * dim / 2];
+}
+
+__attribute__((noinline)) static double matmul(double *c, const double *a, const double *b, size_t dim) {
+  for (size_t i = 0; i < dim; ++i)
+    for (size_t j = 0; j < dim; ++j) {
+      double acc = 0;
+      for (size_t k = 0; k < dim; ++k)
+        acc += a[i * dim + k] * b[k * dim + j];
+      c[i * dim + j] = acc;
+    }
+  return c[dim + 1];
+}
+
+// Data-dependent indices, the checks cannot be hoisted.
+__attribute__((noinline)) static double gather(const double *a, const unsigned *idx, size_t n) {
+  double acc = 0;
+  for (size_t i = 0; i < n; ++i)
+    acc += a[idx[i]];
+  return acc;
+}
+
+int main() {
+  auto *a = static_cast<double *>(std::malloc(N * sizeof(double)));
+  auto *b = static_cast<double *>(std::malloc(N * sizeof(double)));
+  auto *c = static_cast<double *>(std::malloc(N * sizeof(double)));
+  auto *idx = static_cast<unsigned *>(std::malloc(N * sizeof(unsigned)));
+  for (size_t i = 0; i < N; ++i) {
+    a[i] = 0;
+    b[i] = static_cast<double>(i % 97);
+    c[i] = static_cast<double>(i % 13);
+    idx[i] = static_cast<unsigned>((i * 2654435761u) % N);
+  }
+  run("triad", [&]() { return triad(a, b, c, N); });
+  run("stencil", [&]() { return stencil(a, b, Dim); });
+  run("matmul", [&]() { return matmul(a, b, c, MatDim); });
+  run("gather", [&]() { return gather(b, idx, N); });
+  std::free(a);
+  std::free(b);
+  std::free(c);
+  std::free(idx);
+  return 0;
+}
@@ -0,0 +1,100 @@
+// Attaches to the shared-memory metrics segment of a running ptr-reflect process and prints its counters.
+// Usage: metrics <pid> [interval_ms]
+// With an interval, keeps sampling and also prints allocation rates until the process exits.
+
+#include <chrono>
+#include <csignal>
+#include <cstdio>
+#include <cstdlib>
+#include <thread>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "rt_metrics.hpp"
+#include "rt_reflect.hpp"
+
+using namespace ptr_reflect;
+
+// The writer is another process that can be stopped or killed halfway through an update, leaving the sequence odd for good, so the wait
+// is bounded and a page that stays mid-write for that long is reported as stale.
+static bool snapshot(const MetricsPage *page, MetricsCounters &out) {
+  const auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(100);
+  do {
+    uint64_t seq;
+    if (page->seq.tryReadBegin(seq)) {
+      std::memcpy(&out, &page->counters, sizeof(MetricsCounters));
+      if (page->seq.readValid(seq)) return true;
+    }
+    std::this_thread::yield();
+  } while (std::chrono::steady_clock::now() < deadline);
+  return false;
+}
+
+static void print(const MetricsPage *page, const MetricsCounters &now, const MetricsCounters *prev) {
+  const double elapsed = static_cast<double>(now.updatedNs - page->startNs) / 1e9;
+  const double window = prev ? static_cast<double>(now.updatedNs - prev->updatedNs) / 1e9 : 0;
+  std::printf("pid %" PRId64 " up %.1fs\n", page->pid, elapsed);
+  std::printf("  %-18s %14s %12s %14s %12s %12s\n", "type", "liveBytes", "liveCount", "allocs", "frees", "allocs/s");
+  for (size_t t = 0; t < MetricsCounters::Types; ++t) {
+    const auto &c = now.types[t];
+    if (!c.allocs && !c.frees) continue;
+    double rate = 0;
+    if (prev && window > 0) rate = static_cast<double>(c.allocs - prev->types[t].allocs) / window;
+    else if (elapsed > 0) rate = static_cast<double>(c.allocs) / elapsed;
+    std::printf("  %-18s %14" PRIu64 " %12" PRIu64 " %14" PRIu64 " %12" PRIu64 " %12.0f\n", //
+                to_string(static_cast<_rt_Type>(t)), c.liveBytes, c.liveCount, c.allocs, c.frees, rate);
+  }
+  const double load = now.tableBuckets ? static_cast<double>(now.tableSize) / static_cast<double>(now.tableBuckets) : 0;
+  std::printf("  table: %" PRIu64 " entries, %" PRIu64 " buckets, load factor %.3f\n", now.tableSize, now.tableBuckets, load);
+  std::printf("  trace: %" PRIu64 " events, %" PRIu64 " pending flush\n", now.traceEvents, now.traceBacklog);
+  std::fflush(stdout);
+}
+
+int main(int argc, char **argv) {
+  if (argc < 2) {
+    std::fprintf(stderr, "Usage: %s <pid> [interval_ms]\n", argv[0]);
+    return EXIT_FAILURE;
+  }
+  const long pid = std::strtol(argv[1], nullptr, 10);
+  const long interval = argc > 2 ? std::strtol(argv[2], nullptr, 10) : 0;
+
+  char name[64];
+  metricsSegmentName(name, pid);
+  int fd = shm_open(name, O_RDONLY, 0);
+  if (fd < 0) {
+    std::fprintf(stderr, "Unable to open /dev/shm%s, is the process running with ptr-reflect?\n", name);
+    return EXIT_FAILURE;
+  }
+  void *mem = mmap(nullptr, sizeof(MetricsPage), PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (mem == MAP_FAILED) {
+    std::perror("mmap");
+    return EXIT_FAILURE;
+  }
+  const auto *page = static_cast<const MetricsPage *>(mem);
+  if (page->magic != MetricsPage::Magic || page->version != MetricsPage::Version || page->size != sizeof(MetricsPage)) {
+    std::fprintf(stderr, "Segment %s has an incompatible layout (version %u, expected %u)\n", name, page->version, MetricsPage::Version);
+    return EXIT_FAILURE;
+  }
+
+  MetricsCounters prev{}, now{};
+  if (!snapshot(page, now)) {
+    std::fprintf(stderr, "Unable to read a consistent snapshot, the page is stale (process stopped or died mid-update?)\n");
+    return EXIT_FAILURE;
+  }
+  print(page, now, nullptr);
+  while (interval > 0 && kill(static_cast<pid_t>(pid), 0) == 0) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(interval));
+    prev = now;
+    if (snapshot(page, now)) print(page, now, &prev);
+    else {
+      now = prev;
+      std::printf("pid %ld: page is stale, still mid-update\n", pid);
+      std::fflush(stdout);
+    }
+  }
+  munmap(mem, sizeof(MetricsPage));
+  return EXIT_SUCCESS;
+}
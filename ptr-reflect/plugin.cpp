@@ -1,17 +1,339 @@
 #include <filesystem>
+#include <map>
 #include <unordered_set>
 
+#include "llvm/ADT/MapVector.h"
+#include "llvm/Analysis/BlockFrequencyInfo.h"
+#include "llvm/Analysis/LoopInfo.h"
+#include "llvm/Analysis/ProfileSummaryInfo.h"
+#include "llvm/Analysis/ScalarEvolution.h"
+#include "llvm/Analysis/ScalarEvolutionExpressions.h"
+#include "llvm/Analysis/ValueTracking.h"
 #include "llvm/IR/DebugInfoMetadata.h"
+#include "llvm/IR/Dominators.h"
 #include "llvm/IR/IRBuilder.h"
+#include "llvm/IR/InstIterator.h"
 #include "llvm/Passes/PassBuilder.h"
 #include "llvm/Passes/PassPlugin.h"
+#include "llvm/Support/GlobPattern.h"
+#include "llvm/Support/MathExtras.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Transforms/Utils/ScalarEvolutionExpander.h"
 
 #include "../plugin_utils.h"
 #include "rt_reflect.hpp"
 
 namespace {
 
-bool runSplice(llvm::Module &M, const std::string &ResultFile) {
+// Functions selected by PTR_REFLECT_FILTER: one `allow: <glob>` or `deny: <glob>` rule per line (`#` starts a comment), matched against
+// the mangled and demangled name. The first matching rule wins; allowed functions are instrumented even when hot.
+class FunctionFilter {
+  std::vector<std::pair<bool, llvm::GlobPattern>> rules;
+
+public:
+  enum class Verdict { None, Allow, Deny };
+
+  static FunctionFilter load(const std::optional<std::string> &path) {
+    FunctionFilter filter;
+    if (!path) return filter;
+    auto buffer = llvm::MemoryBuffer::getFile(*path);
+    if (!buffer) {
+      llvm::errs() << "[RecordStackPass] unable to read filter " << *path << ": " << buffer.getError().message() << "\n";
+      return filter;
+    }
+    llvm::SmallVector<llvm::StringRef> lines;
+    (*buffer)->getBuffer().split(lines, '\n', -1, false);
+    for (auto line : lines) {
+      line = line.split('#').first.trim();
+      if (line.empty()) continue;
+      auto [kind, glob] = line.split(':');
+      kind = kind.trim();
+      if (kind != "allow" && kind != "deny") {
+        llvm::errs() << "[RecordStackPass] ignoring malformed filter rule: " << line << "\n";
+        continue;
+      }
+      if (auto pattern = llvm::GlobPattern::create(glob.trim())) filter.rules.emplace_back(kind == "allow", std::move(*pattern));
+      else llvm::errs() << "[RecordStackPass] ignoring filter rule " << line << ": " << llvm::toString(pattern.takeError()) << "\n";
+    }
+    return filter;
+  }
+
+  [[nodiscard]] Verdict match(llvm::StringRef name, llvm::StringRef demangled) const {
+    for (auto &[allow, pattern] : rules)
+      if (pattern.match(name) || pattern.match(demangled)) return allow ? Verdict::Allow : Verdict::Deny;
+    return Verdict::None;
+  }
+};
+
+// What to do with stack objects in hot code: leave them uninstrumented, or record them once per call at function entry/exit instead of
+// once per lifetime (PTR_REFLECT_HOT_MODE=skip|hoist).
+enum class HotMode { Skip, Hoist };
+
+struct LifetimeMarker {
+  llvm::CallBase *CB;
+  bool start;
+};
+
+// A user allocator annotated with __RT_ALLOCATOR(arg) or __RT_DEALLOCATOR(arg), see rt_reflect.hpp.
+struct AnnotatedAllocator {
+  llvm::Function *F;
+  bool alloc;
+  unsigned arg;
+};
+
+// The argument of an annotation is lowered to a pointer to a constant struct of the annotation's extra arguments.
+unsigned annotationIndexArg(llvm::Value *Arg) {
+  if (auto *C = llvm::dyn_cast_or_null<llvm::Constant>(Arg))
+    if (auto *GV = getValueOneLevel<llvm::GlobalVariable>(C); GV && GV->hasInitializer())
+      if (auto *CS = llvm::dyn_cast<llvm::ConstantStruct>(GV->getInitializer()); CS && CS->getNumOperands() > 0)
+        if (auto *CI = llvm::dyn_cast<llvm::ConstantInt>(CS->getOperand(0))) return CI->getZExtValue();
+  return 0;
+}
+
+void instrumentAllocator(const AnnotatedAllocator &A, llvm::Function *RecordFn, llvm::Function *ReleaseFn, llvm::raw_ostream &out) {
+  auto &C = A.F->getContext();
+  auto *Arg = A.F->getArg(A.arg);
+  llvm::DILocation *zeroDebugLoc{};
+  if (auto SP = A.F->getSubprogram()) zeroDebugLoc = llvm::DILocation::get(C, 0, 0, SP);
+  llvm::IRBuilder<> B(C);
+  if (A.alloc) {
+    for (llvm::BasicBlock &BB : *A.F) {
+      auto *R = llvm::dyn_cast<llvm::ReturnInst>(BB.getTerminator());
+      if (!R) continue;
+      if (auto *MustTail = BB.getTerminatingMustTailCall()) B.SetInsertPoint(MustTail);
+      else B.SetInsertPoint(R);
+      auto size = B.CreateZExtOrTrunc(Arg, RecordFn->getArg(1)->getType());
+      auto alloc = B.getInt8(ptr_reflect::to_integral(ptr_reflect::_rt_Type::HeapCustom));
+      auto Call = B.CreateCall(RecordFn, {R->getReturnValue(), size, alloc});
+      if (zeroDebugLoc) Call->setDebugLoc(zeroDebugLoc);
+    }
+  } else {
+    B.SetInsertPoint(&*A.F->getEntryBlock().getFirstInsertionPt());
+    auto dealloc = B.getInt8(ptr_reflect::to_integral(ptr_reflect::_rt_Type::HeapCustomFree));
+    auto Call = B.CreateCall(ReleaseFn, {Arg, dealloc});
+    if (zeroDebugLoc) Call->setDebugLoc(zeroDebugLoc);
+  }
+  out << "  - " << demangleCXXName(A.F->getName().data()).value_or(A.F->getName().str()) << ":\n";
+  out << "    kind: " << (A.alloc ? "alloc" : "free") << "\n";
+  out << "    argument: " << A.arg << "\n";
+}
+
+// True if the heap pointer can only be dereferenced, compared or queried: it is never freed, reallocated or stored anywhere.
+bool onlyAccessedOrQueried(llvm::Value *Ptr, llvm::Function *QueryFn) {
+  llvm::SmallVector<llvm::Value *, 8> Worklist{Ptr};
+  llvm::SmallPtrSet<llvm::Value *, 8> Visited;
+  while (!Worklist.empty()) {
+    auto *V = Worklist.pop_back_val();
+    if (!Visited.insert(V).second) continue;
+    for (llvm::Use &U : V->uses()) {
+      auto *I = llvm::dyn_cast<llvm::Instruction>(U.getUser());
+      if (!I) return false;
+      if (llvm::isa<llvm::GetElementPtrInst, llvm::BitCastInst>(I)) Worklist.push_back(I);
+      else if (llvm::isa<llvm::LoadInst, llvm::ICmpInst>(I)) continue;
+      else if (auto *SI = llvm::dyn_cast<llvm::StoreInst>(I); SI && U.getOperandNo() == SI->getPointerOperandIndex()) continue;
+      else if (auto *CB = llvm::dyn_cast<llvm::CallBase>(I); CB && CB->getCalledFunction() == QueryFn && U.getOperandNo() == 0) continue;
+      else return false;
+    }
+  }
+  return true;
+}
+
+struct Extent {
+  uint64_t size;
+  ptr_reflect::_rt_Type type;
+  bool mayBeNull; // heap allocations that can fail, the runtime never records null
+};
+
+// The extent of an object as the runtime would record it, if it is known at compile time.
+std::optional<Extent> provableExtent(llvm::Value *Base, const llvm::DataLayout &DL, llvm::Function *QueryFn) {
+  using ptr_reflect::_rt_Type;
+  if (auto *AI = llvm::dyn_cast<llvm::AllocaInst>(Base)) {
+    auto size = AI->getAllocationSize(DL);
+    if (!AI->isStaticAlloca() || !size || size->isScalable()) return {};
+    return Extent{size->getFixedValue(), _rt_Type::StackAlloc, false};
+  }
+  if (auto *GV = llvm::dyn_cast<llvm::GlobalVariable>(Base)) {
+    if (GV->isDeclaration() || GV->isInterposable() || GV->isThreadLocal()) return {};
+    return Extent{DL.getTypeAllocSize(GV->getValueType()).getFixedValue(), _rt_Type::Global, false};
+  }
+  auto *CB = llvm::dyn_cast<llvm::CallBase>(Base);
+  auto *Callee = CB ? CB->getCalledFunction() : nullptr;
+  if (!Callee) return {};
+  const auto constantArg = [&](unsigned i) -> std::optional<uint64_t> {
+    if (auto *CI = llvm::dyn_cast<llvm::ConstantInt>(CB->getArgOperand(i))) return CI->getZExtValue();
+    return {};
+  };
+  const auto name = Callee->getName();
+  std::optional<Extent> extent;
+  if (name == "malloc" && CB->arg_size() == 1) {
+    if (auto size = constantArg(0)) extent = Extent{*size, _rt_Type::HeapMalloc, true};
+  } else if (name == "calloc" && CB->arg_size() == 2) {
+    auto count = constantArg(0), size = constantArg(1);
+    bool overflow = false;
+    if (count && size) {
+      const uint64_t total = llvm::SaturatingMultiply(*count, *size, &overflow);
+      if (!overflow) extent = Extent{total, _rt_Type::HeapCalloc, true};
+    }
+  } else if ((name == "_Znwm" || name == "_Znam" || name == "_Znwj" || name == "_Znaj") && CB->arg_size() == 1) {
+    if (auto size = constantArg(0)) extent = Extent{*size, _rt_Type::HeapCXXNew, false}; // throws instead of returning null
+  }
+  if (extent && !onlyAccessedOrQueried(CB, QueryFn)) return {};
+  return extent;
+}
+
+// Replaces _rt_query calls (what reflect() and reflectSize() reduce to once inlined) on a pointer at a constant, in-bounds offset from an
+// object of provable extent with a copy of a constant _rt_PtrInfo. Only the base address, unless it is a global, is patched in at runtime.
+size_t foldQueries(llvm::Module &M, const std::unordered_set<llvm::Function *> &ProtectedFunctions, llvm::raw_ostream &out) {
+  auto *QueryFn = M.getFunction("_rt_query");
+  if (!QueryFn) return 0;
+  auto &C = M.getContext();
+  const auto &DL = M.getDataLayout();
+  auto *IntPtrTy = DL.getIntPtrType(C);
+  auto *InfoTy = llvm::StructType::get(C, {IntPtrTy, IntPtrTy, llvm::Type::getInt8Ty(C)}); // same layout as _rt_PtrInfo
+  std::map<std::tuple<uint64_t, uint8_t, llvm::Constant *>, llvm::GlobalVariable *> Infos;
+
+  std::vector<llvm::CallBase *> Queries;
+  for (llvm::User *U : QueryFn->users())
+    if (auto *CB = llvm::dyn_cast<llvm::CallBase>(U); CB && CB->getCalledFunction() == QueryFn)
+      if (ProtectedFunctions.count(CB->getFunction()) == 0) Queries.push_back(CB);
+
+  size_t folded = 0;
+  for (auto *CB : Queries) {
+    int64_t offset = 0;
+    auto *Base = llvm::GetPointerBaseWithConstantOffset(CB->getArgOperand(0), offset, DL);
+    auto extent = provableExtent(Base, DL, QueryFn);
+    if (!extent || offset < 0 || static_cast<uint64_t>(offset) >= std::max<uint64_t>(extent->size, 1)) continue;
+
+    auto *ConstantBase = llvm::dyn_cast<llvm::GlobalVariable>(Base);
+    auto &Info = Infos[{extent->size, ptr_reflect::to_integral(extent->type), ConstantBase}];
+    if (!Info) {
+      auto *Init = llvm::ConstantStruct::get(
+          InfoTy, {ConstantBase ? llvm::ConstantExpr::getPtrToInt(ConstantBase, IntPtrTy) : llvm::ConstantInt::get(IntPtrTy, 0),
+                   llvm::ConstantInt::get(IntPtrTy, extent->size),
+                   llvm::ConstantInt::get(llvm::Type::getInt8Ty(C), ptr_reflect::to_integral(extent->type))});
+      Info = new llvm::GlobalVariable(M, InfoTy, true, llvm::GlobalValue::PrivateLinkage, Init, "__rt_folded_info");
+      Info->setUnnamedAddr(llvm::GlobalValue::UnnamedAddr::Global);
+    }
+
+    out << "  - function: " << demangleCXXName(CB->getFunction()->getName().data()).value_or(CB->getFunction()->getName().str()) << "\n";
+    out << "    instruction: '" << *CB << "'\n";
+    out << "    base: '" << *Base << "'\n";
+    out << "    kind: " << ptr_reflect::to_string(extent->type) << "\n";
+    out << "    size: " << extent->size << "\n";
+    out << "    offset: " << offset << "\n";
+
+    auto *Out = CB->getArgOperand(1);
+    llvm::IRBuilder<> B(CB);
+    B.CreateMemCpy(Out, Out->getPointerAlignment(DL), Info, DL.getABITypeAlign(InfoTy), DL.getTypeAllocSize(InfoTy));
+    if (!ConstantBase) B.CreateStore(B.CreatePtrToInt(Base, IntPtrTy), Out);
+    llvm::Value *Found = B.getTrue();
+    if (extent->mayBeNull) Found = B.CreateIsNotNull(Base);
+    CB->replaceAllUsesWith(Found);
+    CB->eraseFromParent();
+    folded++;
+  }
+  return folded;
+}
+
+struct BoundsStats {
+  size_t checks, ranges, elided, redundant, untracked;
+};
+
+// Bounds-checking mode (PTR_REFLECT_BOUNDS): loads and stores that are not provably in bounds get a _rt_check against the runtime record
+// of their underlying object. An access at an affine stride in a loop that always runs to completion is checked once for all iterations
+// with a _rt_check_range in the preheader, and a check dominated by an identical one is dropped.
+void insertBoundsChecks(llvm::Function &F, llvm::FunctionAnalysisManager &FAM, llvm::Function *CheckFn, llvm::Function *RangeFn,
+                        BoundsStats &stats) {
+  struct Access {
+    llvm::Instruction *I;
+    llvm::Value *Ptr;
+    uint64_t size;
+  };
+  const auto &DL = F.getParent()->getDataLayout();
+  std::vector<Access> Accesses;
+  for (llvm::Instruction &I : llvm::instructions(F)) {
+    llvm::Value *Ptr{};
+    llvm::Type *Ty{};
+    if (auto *Load = llvm::dyn_cast<llvm::LoadInst>(&I)) Ptr = Load->getPointerOperand(), Ty = Load->getType();
+    else if (auto *Store = llvm::dyn_cast<llvm::StoreInst>(&I)) Ptr = Store->getPointerOperand(), Ty = Store->getValueOperand()->getType();
+    else continue;
+    const auto size = DL.getTypeStoreSize(Ty);
+    if (size.isScalable() || Ptr->getType()->getPointerAddressSpace() != 0) continue;
+    Accesses.push_back({&I, Ptr, size.getFixedValue()});
+  }
+  if (Accesses.empty()) return;
+
+  auto &DT = FAM.getResult<llvm::DominatorTreeAnalysis>(F);
+  auto &LI = FAM.getResult<llvm::LoopAnalysis>(F);
+  auto &SE = FAM.getResult<llvm::ScalarEvolutionAnalysis>(F);
+  auto *SizeTy = CheckFn->getArg(2)->getType();
+  llvm::SCEVExpander Expander(SE, DL, "rt.bounds");
+
+  // Hoisting is only sound if every iteration up to the trip count reaches the access: no early exits, no calls that may not return.
+  // Decided before any check is inserted, the checks themselves may not return.
+  llvm::SmallPtrSet<llvm::Loop *, 8> RunsToCompletion;
+  for (llvm::Loop *L : LI.getLoopsInPreorder())
+    if (L->getLoopPreheader() && L->getExitingBlock() && L->getExitingBlock() == L->getLoopLatch() &&
+        llvm::all_of(L->blocks(), [](llvm::BasicBlock *BB) { return llvm::isGuaranteedToTransferExecutionToSuccessor(BB); }))
+      RunsToCompletion.insert(L);
+
+  std::map<std::tuple<llvm::Value *, const llvm::SCEV *, const llvm::SCEV *, uint64_t>, llvm::SmallVector<llvm::Instruction *, 2>> Ranges;
+  llvm::DenseMap<llvm::Value *, llvm::SmallVector<std::pair<llvm::Instruction *, uint64_t>, 2>> Checked;
+  for (auto &A : Accesses) {
+    auto *Base = llvm::getUnderlyingObject(A.Ptr);
+    if (llvm::isa<llvm::Constant>(Base)) { // globals and constant addresses are never recorded, the check would always pass
+      stats.untracked++;
+      continue;
+    }
+    int64_t offset = 0;
+    if (auto *AI = llvm::dyn_cast<llvm::AllocaInst>(llvm::GetPointerBaseWithConstantOffset(A.Ptr, offset, DL))) {
+      auto size = AI->getAllocationSize(DL);
+      if (size && !size->isScalable() && offset >= 0 && static_cast<uint64_t>(offset) + A.size <= size->getFixedValue()) {
+        stats.elided++;
+        continue;
+      }
+    }
+
+    auto *L = LI.getLoopFor(A.I->getParent());
+    auto *AR = L ? llvm::dyn_cast<llvm::SCEVAddRecExpr>(SE.getSCEV(A.Ptr)) : nullptr;
+    if (AR && AR->getLoop() == L && AR->isAffine() && L->isLoopInvariant(Base) && RunsToCompletion.count(L) &&
+        DT.dominates(A.I->getParent(), L->getLoopLatch())) {
+      auto *TripCount = SE.getBackedgeTakenCount(L);
+      auto *InsertPt = L->getLoopPreheader()->getTerminator();
+      auto *BaseInst = llvm::dyn_cast<llvm::Instruction>(Base);
+      if (!llvm::isa<llvm::SCEVCouldNotCompute>(TripCount) && (!BaseInst || DT.dominates(BaseInst, InsertPt))) {
+        auto *First = AR->getStart(), *Last = AR->evaluateAtIteration(TripCount, SE);
+        if (Expander.isSafeToExpandAt(First, InsertPt) && Expander.isSafeToExpandAt(Last, InsertPt)) {
+          // equal SCEVs can come from loops in disjoint branches, a prior check only covers this loop if it dominates the preheader
+          auto &Prior = Ranges[{Base, First, Last, A.size}];
+          if (llvm::none_of(Prior, [&](auto *p) { return DT.dominates(p, InsertPt); })) {
+            auto *PtrTy = A.Ptr->getType();
+            auto *Call = llvm::CallInst::Create(RangeFn,
+                                                {Base, Expander.expandCodeFor(First, PtrTy, InsertPt),
+                                                 Expander.expandCodeFor(Last, PtrTy, InsertPt), llvm::ConstantInt::get(SizeTy, A.size)},
+                                                "", InsertPt);
+            Call->setDebugLoc(A.I->getDebugLoc());
+            Prior.push_back(Call);
+            stats.ranges++;
+          } else stats.redundant++;
+          continue;
+        }
+      }
+    }
+
+    auto &Prior = Checked[A.Ptr];
+    if (llvm::any_of(Prior, [&](auto &p) { return p.second >= A.size && DT.dominates(p.first, A.I); })) {
+      stats.redundant++;
+      continue;
+    }
+    auto *Call = llvm::CallInst::Create(CheckFn, {Base, A.Ptr, llvm::ConstantInt::get(SizeTy, A.size)}, "", A.I);
+    Call->setDebugLoc(A.I->getDebugLoc());
+    Prior.emplace_back(Call, A.size);
+    stats.checks++;
+  }
+}
+
+bool runSplice(llvm::Module &M, llvm::ModuleAnalysisManager &AM, const std::string &ResultFile) {
   // M.print(llvm::errs(), nullptr);
   tee_ostream out(llvm::nulls(), ResultFile);
   auto &C = M.getContext();
@@ -26,20 +348,62 @@ bool runSplice(llvm::Module &M, const std::string &ResultFile) {
     return false;
   }
 
+  // Hotness comes from PGO data (instrumentation or sample profiles); without a profile summary nothing is considered hot.
+  auto &PSI = AM.getResult<llvm::ProfileSummaryAnalysis>(M);
+  auto &FAM = AM.getResult<llvm::FunctionAnalysisManagerModuleProxy>(M).getManager();
+  const auto filter = FunctionFilter::load(getEnv("PTR_REFLECT_FILTER"));
+  const auto hotCutoff = static_cast<int>(getEnvUnsigned("PTR_REFLECT_HOT_CUTOFF", 990000)); // percentile, in parts per million
+  const auto hotMode = getEnv("PTR_REFLECT_HOT_MODE").value_or("skip") == "hoist" ? HotMode::Hoist : HotMode::Skip;
+  const bool profiled = PSI.hasProfileSummary() && hotCutoff > 0;
+
+  size_t instrumented = 0, skipped = 0, hoisted = 0;
+  uint64_t callsAvoided = 0;
+
   out << "module:\n";
   out << "  name: " << M.getName() << "\n";
-  out << "  functions: \n";
 
   std::unordered_set<llvm::Function *> ProtectedFunctions;
-  findFunctionsWithStringAnnotations(M, [&](llvm::Function *F, llvm::StringRef Annotation) {
+  std::vector<AnnotatedAllocator> Allocators;
+  findFunctionsWithStringAnnotationsWithArg(M, [&](llvm::Function *F, llvm::StringRef Annotation, llvm::Value *Arg) {
     if (F && Annotation == "__rt_protect") ProtectedFunctions.emplace(F);
+    if (F && (Annotation == "__rt_alloc" || Annotation == "__rt_free"))
+      Allocators.push_back({F, Annotation == "__rt_alloc", annotationIndexArg(Arg)});
   });
 
+  // The runtime's own interposers carry the same annotations but are protected.
+  out << "  allocators: \n";
+  for (auto &A : Allocators) {
+    if (A.F->isDeclaration() || ProtectedFunctions.count(A.F) > 0) continue;
+    const bool valid = A.arg < A.F->arg_size() &&
+                       (A.alloc ? A.F->getReturnType()->isPointerTy() && A.F->getArg(A.arg)->getType()->isIntegerTy()
+                                : A.F->getArg(A.arg)->getType()->isPointerTy());
+    if (!valid) {
+      llvm::errs() << "[RecordStackPass] ignoring " << A.F->getName() << ": argument " << A.arg << " does not fit its annotation\n";
+      continue;
+    }
+    instrumentAllocator(A, RecordFn, ReleaseFn, out);
+  }
+
+  out << "  folded: \n";
+  const size_t folded = foldQueries(M, ProtectedFunctions, out);
+
+  BoundsStats bounds{};
+  const bool checkBounds = getEnv("PTR_REFLECT_BOUNDS").has_value();
+  auto CheckFn = M.getFunction("_rt_check"), RangeFn = M.getFunction("_rt_check_range");
+  if (checkBounds && (!CheckFn || !RangeFn)) llvm::errs() << "[RecordStackPass] _rt_check or _rt_check_range not found, no bounds checks\n";
+  else if (checkBounds) {
+    for (llvm::Function &F : M)
+      if (!F.isDeclaration() && ProtectedFunctions.count(&F) == 0) insertBoundsChecks(F, FAM, CheckFn, RangeFn, bounds);
+  }
+
+  out << "  functions: \n";
+
   for (llvm::Function &F : M) {
     if (F.isDeclaration()) continue;
     if (ProtectedFunctions.count(&F) > 0) continue;
 
-    out << "  - " << demangleCXXName(F.getName().data()).value_or(F.getName().data()) << ":\n";
+    const auto demangled = demangleCXXName(F.getName().data()).value_or(F.getName().str());
+    out << "  - " << demangled << ":\n";
     out << "    calls: \n";
 
     llvm::DILocation *zeroDebugLoc{};
@@ -47,42 +411,121 @@ bool runSplice(llvm::Module &M, const std::string &ResultFile) {
       zeroDebugLoc = llvm::DILocation::get(C, 0, 0, SP);
     }
 
+    const auto verdict = filter.match(F.getName(), demangled);
+    llvm::BlockFrequencyInfo *BFI{};
+    if (profiled && verdict == FunctionFilter::Verdict::None) BFI = &FAM.getResult<llvm::BlockFrequencyAnalysis>(F);
+    const bool hotFunction = BFI && PSI.isFunctionHotInCallGraphNthPercentile(hotCutoff, &F, *BFI);
+    const auto blockCount = [&](llvm::BasicBlock *BB) -> uint64_t { return BFI ? BFI->getBlockProfileCount(BB).value_or(0) : 0; };
+    // Hoisting moves the release to the returns, which is only sound if the frame cannot be left any other way.
+    const bool canHoist = hotMode == HotMode::Hoist && F.doesNotThrow() && !F.callsFunctionThatReturnsTwice();
+
+    // Group markers by stack object so that both ends of a lifetime are always treated alike: a recorded start with a skipped end would
+    // leave a stale record behind.
+    llvm::MapVector<llvm::Value *, llvm::SmallVector<LifetimeMarker, 2>> Objects;
     for (llvm::BasicBlock &BB : F) {
-      std::vector<std::function<void(llvm::IRBuilder<> &)>> Functions;
       for (llvm::Instruction &I : BB) {
         if (auto *CB = llvm::dyn_cast<llvm::CallBase>(&I)) {
-          auto F = CB->getCalledFunction();
-          if (!F) continue;
-          const auto name = F->getName().str();
-          const auto log = [&]() {
-            out << "    - instruction: '" << *CB << "'\n";
-            out << "      name: " << name << "\n";
-          };
-          if (CB->getIntrinsicID() == llvm::Intrinsic::lifetime_start) {
-            log();
-            Functions.emplace_back([RecordFn, CB, zeroDebugLoc](llvm::IRBuilder<> &B) {
-              B.SetInsertPoint(CB->getNextNode()); // after start
-              auto alloc = B.getInt8(ptr_reflect::to_integral(ptr_reflect::_rt_Type::StackAlloc));
-              auto Call = B.CreateCall(RecordFn, {CB->getArgOperand(1), CB->getArgOperand(0), alloc});
-              if (zeroDebugLoc) Call->setDebugLoc(zeroDebugLoc);
-            });
-          }
-          if (CB->getIntrinsicID() == llvm::Intrinsic::lifetime_end) {
-            log();
-            Functions.emplace_back([ReleaseFn, CB, zeroDebugLoc](llvm::IRBuilder<> &B) {
-              B.SetInsertPoint(CB); // before end
-              auto dealloc = B.getInt8(ptr_reflect::to_integral(ptr_reflect::_rt_Type::StackFree));
-              auto Call = B.CreateCall(ReleaseFn, {CB->getArgOperand(1), dealloc});
-              if (zeroDebugLoc) Call->setDebugLoc(zeroDebugLoc);
-            });
+          if (CB->getIntrinsicID() == llvm::Intrinsic::lifetime_start)
+            Objects[llvm::getUnderlyingObject(CB->getArgOperand(1))].push_back({CB, true});
+          if (CB->getIntrinsicID() == llvm::Intrinsic::lifetime_end)
+            Objects[llvm::getUnderlyingObject(CB->getArgOperand(1))].push_back({CB, false});
+        }
+      }
+    }
+
+    std::vector<std::string> skippedLog;
+    for (auto &[Object, Markers] : Objects) {
+      const char *reason{};
+      if (verdict == FunctionFilter::Verdict::Deny) reason = "denied";
+      else if (hotFunction) reason = "hot-function";
+      else if (BFI && llvm::any_of(Markers, [&](auto &m) { return PSI.isHotBlockNthPercentile(hotCutoff, m.CB->getParent(), BFI); }))
+        reason = "hot-block";
+
+      if (!reason) {
+        for (auto &[CB, start] : Markers) {
+          out << "    - instruction: '" << *CB << "'\n";
+          out << "      name: " << CB->getCalledFunction()->getName() << "\n";
+          llvm::IRBuilder<> B(C);
+          if (start) {
+            B.SetInsertPoint(CB->getNextNode()); // after start
+            auto alloc = B.getInt8(ptr_reflect::to_integral(ptr_reflect::_rt_Type::StackAlloc));
+            auto Call = B.CreateCall(RecordFn, {CB->getArgOperand(1), CB->getArgOperand(0), alloc});
+            if (zeroDebugLoc) Call->setDebugLoc(zeroDebugLoc);
+          } else {
+            B.SetInsertPoint(CB); // before end
+            auto dealloc = B.getInt8(ptr_reflect::to_integral(ptr_reflect::_rt_Type::StackFree));
+            auto Call = B.CreateCall(ReleaseFn, {CB->getArgOperand(1), dealloc});
+            if (zeroDebugLoc) Call->setDebugLoc(zeroDebugLoc);
           }
+          instrumented++;
         }
+        continue;
       }
-      llvm::IRBuilder<> B(&BB);
-      for (auto f : Functions)
-        f(B);
+
+      uint64_t calls = 0;
+      for (auto &m : Markers)
+        calls += blockCount(m.CB->getParent());
+
+      std::string entry;
+      llvm::raw_string_ostream log(entry);
+      log << "    - object: '" << *Object << "'\n";
+      log << "      reason: " << reason << "\n";
+
+      auto *AI = llvm::dyn_cast<llvm::AllocaInst>(Object);
+      auto size = AI ? AI->getAllocationSize(M.getDataLayout()) : std::nullopt;
+      if (canHoist && verdict != FunctionFilter::Verdict::Deny && AI && AI->isStaticAlloca() && size && !size->isScalable()) {
+        // Dropping the markers also keeps stack colouring from sharing the slot, which would otherwise record the same address twice.
+        for (auto &m : Markers)
+          m.CB->eraseFromParent();
+        llvm::IRBuilder<> B(C);
+        B.SetInsertPoint(&*F.getEntryBlock().getFirstNonPHIOrDbgOrAlloca());
+        auto alloc = B.getInt8(ptr_reflect::to_integral(ptr_reflect::_rt_Type::StackAlloc));
+        auto Call = B.CreateCall(RecordFn, {AI, llvm::ConstantInt::get(RecordFn->getArg(1)->getType(), size->getFixedValue()), alloc});
+        if (zeroDebugLoc) Call->setDebugLoc(zeroDebugLoc);
+        for (llvm::BasicBlock &BB : F) {
+          if (!llvm::isa<llvm::ReturnInst>(BB.getTerminator())) continue;
+          if (auto *MustTail = BB.getTerminatingMustTailCall()) B.SetInsertPoint(MustTail);
+          else B.SetInsertPoint(BB.getTerminator());
+          auto dealloc = B.getInt8(ptr_reflect::to_integral(ptr_reflect::_rt_Type::StackFree));
+          auto Release = B.CreateCall(ReleaseFn, {AI, dealloc});
+          if (zeroDebugLoc) Release->setDebugLoc(zeroDebugLoc);
+        }
+        const uint64_t perCall = 2 * blockCount(&F.getEntryBlock());
+        calls = calls > perCall ? calls - perCall : 0;
+        log << "      action: hoisted\n";
+        hoisted++;
+      } else {
+        log << "      action: skipped\n";
+        skipped++;
+      }
+      log << "      markers: " << Markers.size() << "\n";
+      log << "      estimatedCallsAvoided: " << calls << "\n";
+      callsAvoided += calls;
+      skippedLog.emplace_back(std::move(log.str()));
+    }
+
+    if (!skippedLog.empty()) {
+      out << "    skipped: \n";
+      for (auto &entry : skippedLog)
+        out << entry;
     }
   }
+
+  out << "  summary:\n";
+  out << "    profile: " << (profiled ? "true" : "false") << "\n";
+  out << "    foldedQueries: " << folded << "\n";
+  out << "    instrumentedMarkers: " << instrumented << "\n";
+  out << "    skippedObjects: " << skipped << "\n";
+  out << "    hoistedObjects: " << hoisted << "\n";
+  out << "    estimatedCallsAvoided: " << callsAvoided << "\n";
+  if (checkBounds) {
+    out << "    bounds:\n";
+    out << "      checks: " << bounds.checks << "\n";
+    out << "      rangeChecks: " << bounds.ranges << "\n";
+    out << "      elided: " << bounds.elided << "\n";
+    out << "      redundant: " << bounds.redundant << "\n";
+    out << "      untracked: " << bounds.untracked << "\n";
+  }
   out.flush();
   return true;
 }
@@ -101,7 +544,7 @@ public:
     OutputName = guessOutputName().value_or(OutputName);
     auto Output = (OutputName.has_relative_path() ? OutputName.parent_path() : "./") /
                   (OutputName.filename().string() + "_" + ModuleSuffix + ".yaml");
-    if (!runSplice(M, Output)) return llvm::PreservedAnalyses::all();
+    if (!runSplice(M, AM, Output)) return llvm::PreservedAnalyses::all();
     return llvm::PreservedAnalyses::none();
   }
 };
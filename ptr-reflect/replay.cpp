@@ -0,0 +1,392 @@
+// Replays the heap allocations captured in a ptr-reflect trace against an allocator, without rerunning the traced program.
+// Usage: replay <trace_*.json> [system|pool|bump]
+//   system: malloc/calloc/operator new as recorded; swap the general purpose allocator with LD_PRELOAD (e.g. libjemalloc.so)
+//   pool:   per-thread power-of-two size-class free lists up to 4KiB on top of malloc, to evaluate pooling
+//   bump:   per-thread bump arena that never frees, an upper bound for throughput
+// Each traced thread is replayed on its own thread, as fast as possible, in the recorded order. Resizes and frees are replayed on the
+// allocating thread, which owns the object. Stack, custom allocator and mmap events are skipped.
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cinttypes>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <map>
+#include <new>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include <sys/resource.h>
+
+#include "rt_reflect.hpp"
+
+using namespace ptr_reflect;
+
+struct Object {
+  size_t size; // at allocation, resizes follow as separate events
+  int64_t start, end; // microseconds, steady_clock
+  _rt_Type type;
+  uint32_t tid;
+  uint64_t id;
+};
+
+struct Resize {
+  uint64_t id;
+  int64_t time;
+  size_t from, to;
+};
+
+struct Op {
+  enum class Kind : uint8_t { Alloc, Resize, Free }; // order used to break ties
+  int64_t time;
+  uint32_t object;
+  Kind kind;
+  size_t size; // for Alloc and Resize
+  bool operator<(const Op &that) const { return time != that.time ? time < that.time : kind < that.kind; }
+};
+
+static const char *field(const char *line, const char *key) {
+  const char *at = std::strstr(line, key);
+  return at ? at + std::strlen(key) : nullptr;
+}
+
+static bool parseType(const char *name, _rt_Type &out) {
+  for (uint8_t t = 0; t < 16; ++t) {
+    const char *s = to_string(static_cast<_rt_Type>(t));
+    const size_t n = std::strlen(s);
+    if (std::strncmp(name, s, n) == 0 && name[n] == '"') {
+      out = static_cast<_rt_Type>(t);
+      return true;
+    }
+  }
+  return false;
+}
+
+static bool replayable(_rt_Type type) {
+  switch (type) {
+    case _rt_Type::HeapMalloc:
+    case _rt_Type::HeapCalloc:
+    case _rt_Type::HeapRealloc:
+    case _rt_Type::HeapMemalign:
+    case _rt_Type::HeapAlignedAlloc:
+    case _rt_Type::HeapCXXNew: return true;
+    default: return false;
+  }
+}
+
+// One event per line, as written by ReflectService::releaseLocked:
+//   {"name": "0x<ptr> (<size>)","cat": "<type>", "ph": "X", "ts": <start> , "dur": <duration>, "pid": <type>, "tid": <thread>,
+//    "args": {"id": <id>}},
+static bool parseObject(const char *line, Object &out) {
+  const char *name = field(line, "\"name\": \"0x"), *cat = field(line, "\"cat\": \""), *ts = field(line, "\"ts\":"),
+             *dur = field(line, "\"dur\":"), *tid = field(line, "\"tid\":"), *id = field(line, "\"id\":");
+  if (!name || !cat || !ts || !dur || !tid || !id) return false;
+  unsigned long ptr;
+  long size;
+  if (std::sscanf(name, "%lx (%ld)", &ptr, &size) != 2 || size < 0) return false;
+  if (!parseType(cat, out.type)) return false;
+  out.size = static_cast<size_t>(size);
+  out.start = std::strtoll(ts, nullptr, 10);
+  out.end = out.start + std::strtoll(dur, nullptr, 10);
+  out.tid = static_cast<uint32_t>(std::strtoul(tid, nullptr, 10));
+  out.id = std::strtoull(id, nullptr, 10);
+  return true;
+}
+
+// Instant events written by ReflectService::blockingResize:
+//   {"name": "0x<from> -> 0x<to> (<size> -> <size>)","cat": "<type>", "ph": "i", "s": "t", "ts": <time>, ..., "args": {"id": <id>}},
+static bool parseResize(const char *line, Resize &out) {
+  const char *name = field(line, "\"name\": \"0x"), *ts = field(line, "\"ts\":"), *id = field(line, "\"id\":");
+  if (!name || !ts || !id || !std::strstr(line, "\"ph\": \"i\"")) return false;
+  unsigned long from, to;
+  long fromSize, toSize;
+  if (std::sscanf(name, "%lx -> 0x%lx (%ld -> %ld)", &from, &to, &fromSize, &toSize) != 4 || fromSize < 0 || toSize < 0) return false;
+  out.id = std::strtoull(id, nullptr, 10);
+  out.time = std::strtoll(ts, nullptr, 10);
+  out.from = static_cast<size_t>(fromSize);
+  out.to = static_cast<size_t>(toSize);
+  return true;
+}
+
+static void touch(void *ptr, size_t size) { // make the pages resident so RSS reflects the allocator's footprint
+  auto *bytes = static_cast<volatile char *>(ptr);
+  for (size_t offset = 0; offset < size; offset += 4096)
+    bytes[offset] = 1;
+}
+
+class SystemAllocator {
+public:
+  void *allocate(size_t size, _rt_Type type) {
+    switch (type) {
+      case _rt_Type::HeapCalloc: return std::calloc(1, size);
+      case _rt_Type::HeapCXXNew: return ::operator new(size);
+      default: return std::malloc(size);
+    }
+  }
+  void *reallocate(void *ptr, size_t, size_t size, _rt_Type) { return std::realloc(ptr, size); }
+  void deallocate(void *ptr, size_t, _rt_Type type) {
+    if (type == _rt_Type::HeapCXXNew) ::operator delete(ptr);
+    else std::free(ptr);
+  }
+};
+
+// realloc for allocators without one: always moves.
+template <typename Allocator> static void *moveTo(Allocator &allocator, void *ptr, size_t from, size_t to, _rt_Type type) {
+  void *moved = allocator.allocate(to, type);
+  std::memcpy(moved, ptr, std::min(from, to));
+  allocator.deallocate(ptr, from, type);
+  return moved;
+}
+
+class PoolAllocator {
+  static constexpr size_t MinShift = 4, MaxShift = 12, ChunkSize = 64 * 1024;
+  struct FreeNode {
+    FreeNode *next;
+  };
+  FreeNode *freeLists[MaxShift - MinShift + 1]{};
+  std::vector<void *> chunks;
+  char *cursor{}, *end{};
+
+  static size_t classOf(size_t size) {
+    size_t shift = MinShift;
+    while ((size_t{1} << shift) < size)
+      shift++;
+    return shift - MinShift;
+  }
+
+public:
+  void *allocate(size_t size, _rt_Type) {
+    if (size > (size_t{1} << MaxShift)) return std::malloc(size);
+    const size_t c = classOf(size);
+    if (FreeNode *node = freeLists[c]) {
+      freeLists[c] = node->next;
+      return node;
+    }
+    const size_t bytes = size_t{1} << (c + MinShift);
+    if (!cursor || cursor + bytes > end) {
+      cursor = static_cast<char *>(std::malloc(ChunkSize));
+      end = cursor + ChunkSize;
+      chunks.push_back(cursor);
+    }
+    void *ptr = cursor;
+    cursor += bytes;
+    return ptr;
+  }
+  void *reallocate(void *ptr, size_t from, size_t to, _rt_Type type) {
+    const size_t limit = size_t{1} << MaxShift;
+    if (from > limit && to > limit) return std::realloc(ptr, to);
+    if (from <= limit && to <= limit && classOf(from) == classOf(to)) return ptr;
+    return moveTo(*this, ptr, from, to, type);
+  }
+  void deallocate(void *ptr, size_t size, _rt_Type) {
+    if (size > (size_t{1} << MaxShift)) return std::free(ptr);
+    const size_t c = classOf(size);
+    freeLists[c] = new (ptr) FreeNode{freeLists[c]};
+  }
+  ~PoolAllocator() {
+    for (void *chunk : chunks)
+      std::free(chunk);
+  }
+};
+
+class BumpAllocator {
+  static constexpr size_t ChunkSize = 1024 * 1024;
+  std::vector<void *> blocks;
+  char *cursor{}, *end{};
+
+public:
+  void *allocate(size_t size, _rt_Type) {
+    size = (std::max<size_t>(size, 1) + 15) & ~size_t{15};
+    if (size > ChunkSize / 4) return blocks.emplace_back(std::malloc(size));
+    if (!cursor || cursor + size > end) {
+      cursor = static_cast<char *>(blocks.emplace_back(std::malloc(ChunkSize)));
+      end = cursor + ChunkSize;
+    }
+    void *ptr = cursor;
+    cursor += size;
+    return ptr;
+  }
+  void *reallocate(void *ptr, size_t from, size_t to, _rt_Type type) { return moveTo(*this, ptr, from, to, type); }
+  void deallocate(void *, size_t, _rt_Type) {}
+  ~BumpAllocator() {
+    for (void *block : blocks)
+      std::free(block);
+  }
+};
+
+static bool readStatus(const char *key, size_t &bytes) { // VmRSS/VmHWM in /proc/self/status, Linux only
+  std::FILE *status = std::fopen("/proc/self/status", "r");
+  if (!status) return false;
+  char line[256];
+  bool found = false;
+  while (!found && std::fgets(line, sizeof(line), status)) {
+    if (const char *value = field(line, key)) {
+      bytes = std::strtoull(value, nullptr, 10) * 1024;
+      found = true;
+    }
+  }
+  std::fclose(status);
+  return found;
+}
+
+static bool resetPeakRss() { // writing 5 to clear_refs resets VmHWM (Linux >= 4.0)
+  std::FILE *refs = std::fopen("/proc/self/clear_refs", "w");
+  if (!refs) return false;
+  const bool ok = std::fputs("5", refs) >= 0;
+  return std::fclose(refs) == 0 && ok;
+}
+
+static size_t peakRss() {
+  size_t bytes;
+  if (readStatus("VmHWM:", bytes)) return bytes;
+  rusage usage{};
+  getrusage(RUSAGE_SELF, &usage);
+#ifdef __APPLE__
+  return static_cast<size_t>(usage.ru_maxrss);
+#else
+  return static_cast<size_t>(usage.ru_maxrss) * 1024;
+#endif
+}
+
+template <typename Allocator>
+static double replay(const std::vector<Object> &objects, const std::vector<std::vector<Op>> &threads) {
+  std::vector<void *> ptrs(objects.size());
+  std::vector<size_t> sizes(objects.size());
+  std::atomic<bool> go{false};
+  std::vector<std::thread> workers;
+  for (auto &ops : threads) {
+    workers.emplace_back([&]() {
+      Allocator allocator;
+      while (!go.load(std::memory_order_acquire))
+        std::this_thread::yield();
+      for (auto &op : ops) {
+        const Object &o = objects[op.object];
+        void *&ptr = ptrs[op.object];
+        size_t &size = sizes[op.object];
+        switch (op.kind) {
+          case Op::Kind::Alloc:
+            size = op.size;
+            touch(ptr = allocator.allocate(size, o.type), size);
+            break;
+          case Op::Kind::Resize:
+            ptr = allocator.reallocate(ptr, size, op.size, o.type);
+            if (op.size > size) touch(static_cast<char *>(ptr) + size, op.size - size);
+            size = op.size;
+            break;
+          case Op::Kind::Free: allocator.deallocate(ptr, size, o.type); break;
+        }
+      }
+    });
+  }
+  const auto start = std::chrono::steady_clock::now();
+  go.store(true, std::memory_order_release);
+  for (auto &worker : workers)
+    worker.join();
+  return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+int main(int argc, char **argv) {
+  if (argc < 2) {
+    std::fprintf(stderr, "Usage: %s <trace_*.json> [system|pool|bump]\n", argv[0]);
+    return EXIT_FAILURE;
+  }
+  const std::string allocator = argc > 2 ? argv[2] : "system";
+  if (allocator != "system" && allocator != "pool" && allocator != "bump") {
+    std::fprintf(stderr, "Unknown allocator %s, expecting one of system, pool, bump\n", allocator.c_str());
+    return EXIT_FAILURE;
+  }
+
+  std::FILE *in = std::fopen(argv[1], "r");
+  if (!in) {
+    std::perror(argv[1]);
+    return EXIT_FAILURE;
+  }
+  std::vector<Object> objects;
+  std::vector<Resize> resizes;
+  size_t skipped = 0;
+  char *line = nullptr;
+  size_t capacity = 0;
+  while (getline(&line, &capacity, in) != -1) {
+    Object o{};
+    Resize r{};
+    if (parseResize(line, r)) resizes.push_back(r);
+    else if (!parseObject(line, o)) continue;
+    else if (replayable(o.type)) objects.push_back(o);
+    else skipped++;
+  }
+  std::free(line);
+  std::fclose(in);
+  if (objects.empty()) {
+    std::fprintf(stderr, "No heap allocations found in %s\n", argv[1]);
+    return EXIT_FAILURE;
+  }
+
+  // Objects are recorded with their final size, the first resize (if any) has the size at allocation.
+  std::unordered_map<uint64_t, uint32_t> byId;
+  for (uint32_t i = 0; i < objects.size(); ++i)
+    byId.emplace(objects[i].id, i);
+  std::stable_sort(resizes.begin(), resizes.end(), [](auto &l, auto &r) { return l.time < r.time; });
+  std::vector<Op> all;
+  all.reserve(objects.size() * 2 + resizes.size());
+  for (uint32_t i = 0; i < objects.size(); ++i)
+    all.push_back({objects[i].start, i, Op::Kind::Alloc, objects[i].size});
+  size_t replayedResizes = 0;
+  std::vector<bool> resized(objects.size());
+  for (auto &r : resizes) {
+    auto it = byId.find(r.id);
+    if (it == byId.end()) continue; // still live at exit, or not a replayable type
+    if (!resized[it->second]) all[it->second].size = r.from;
+    resized[it->second] = true;
+    all.push_back({r.time, it->second, Op::Kind::Resize, r.to});
+    replayedResizes++;
+  }
+  for (uint32_t i = 0; i < objects.size(); ++i)
+    all.push_back({objects[i].end, i, Op::Kind::Free, 0});
+  std::stable_sort(all.begin(), all.end());
+
+  std::map<uint32_t, std::vector<Op>> byTid;
+  std::vector<size_t> sizes(objects.size());
+  size_t live = 0, peakLive = 0;
+  for (auto &op : all) {
+    switch (op.kind) {
+      case Op::Kind::Alloc: live += sizes[op.object] = op.size; break;
+      case Op::Kind::Resize: live += op.size - sizes[op.object]; sizes[op.object] = op.size; break;
+      case Op::Kind::Free: live -= sizes[op.object]; break;
+    }
+    peakLive = std::max(peakLive, live);
+    byTid[objects[op.object].tid].push_back(op);
+  }
+  std::vector<std::vector<Op>> threads;
+  for (auto &[tid, ops] : byTid)
+    threads.push_back(std::move(ops)); // already in order
+  all = {};
+  byTid = {};
+
+  size_t baseline = 0;
+  const bool exact = resetPeakRss() && readStatus("VmRSS:", baseline);
+  if (!exact) baseline = peakRss();
+
+  double seconds = 0;
+  if (allocator == "system") seconds = replay<SystemAllocator>(objects, threads);
+  else if (allocator == "pool") seconds = replay<PoolAllocator>(objects, threads);
+  else seconds = replay<BumpAllocator>(objects, threads);
+
+  const size_t peak = peakRss(), footprint = peak > baseline ? peak - baseline : 0;
+  const double ops = static_cast<double>(objects.size() * 2 + replayedResizes);
+  std::printf("trace: %zu heap objects, %zu resizes on %zu threads (%zu non-heap events skipped)\n", objects.size(), replayedResizes,
+              threads.size(), skipped);
+  std::printf("allocator: %s\n", allocator.c_str());
+  std::printf("  time:          %.3f ms\n", seconds * 1e3);
+  std::printf("  throughput:    %.2f Mops/s\n", seconds > 0 ? ops / seconds / 1e6 : 0);
+  std::printf("  peak live:     %zu bytes (requested)\n", peakLive);
+  std::printf("  peak RSS:      %zu bytes above a %zu byte baseline%s\n", footprint, baseline, exact ? "" : " (approximate)");
+  if (footprint > 0) {
+    const double fragmentation = 1.0 - static_cast<double>(peakLive) / static_cast<double>(footprint);
+    std::printf("  fragmentation: %.1f%%\n", std::max(0.0, fragmentation) * 100);
+  }
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,134 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <new>
+
+#include <sys/mman.h>
+
+#include "rt_protected.hpp"
+#include "rt_seqlock.hpp"
+
+namespace ptr_reflect::details {
+
+// Size-class segregated arena for small heap allocations, enabled by defining PTR_REFLECT_ARENA before including rt.hpp.
+// A single reservation is split into one region per (allocation type, power-of-two size class), so an address alone gives its record:
+//   region = (addr - base) >> RegionShift, type = region / Classes, class = region % Classes, slot = (addr - region) >> class shift
+// Each region starts with the requested size + 1 of every slot (0 for free slots); the slots overlapping that header are never handed
+// out. Pages are committed on first touch, and lookups are plain loads: no table and no lock.
+class Arena {
+public:
+  static constexpr size_t MinShift = 4, Classes = 8, Types = 16, RegionShift = 28; // 16 to 2048 bytes, 256MiB per region
+  static constexpr size_t RegionSize = size_t{1} << RegionShift, Regions = Types * Classes;
+  static constexpr size_t MaxSize = size_t{1} << (MinShift + Classes - 1);
+
+private:
+  struct FreeSlot {
+    FreeSlot *next;
+  };
+
+  struct Region {
+    std::atomic_flag lock = ATOMIC_FLAG_INIT; // only taken to allocate and free, never to look up
+    FreeSlot *free{};
+    size_t next{}; // first slot never handed out
+  };
+
+  uintptr_t base{};
+  Region regions[Regions]{};
+
+  __RT_PROTECT static size_t classOf(size_t size) {
+    return size <= (size_t{1} << MinShift) ? 0 : 64 - __builtin_clzll(size - 1) - MinShift;
+  }
+  __RT_PROTECT static size_t shiftOf(size_t region) { return MinShift + region % Classes; }
+  __RT_PROTECT uintptr_t regionBase(size_t region) const { return base + (region << RegionShift); }
+  __RT_PROTECT uint16_t *sizes(size_t region) const { return reinterpret_cast<uint16_t *>(regionBase(region)); }
+  __RT_PROTECT static size_t firstSlot(size_t region) {
+    const size_t header = (RegionSize >> shiftOf(region)) * sizeof(uint16_t);
+    return (header + (size_t{1} << shiftOf(region)) - 1) >> shiftOf(region);
+  }
+
+  __RT_PROTECT void lock(Region &r) {
+    while (r.lock.test_and_set(std::memory_order_acquire))
+      SeqLock::pause();
+  }
+  __RT_PROTECT void unlock(Region &r) { r.lock.clear(std::memory_order_release); }
+
+public:
+  __RT_PROTECT Arena() {
+    const size_t total = Regions << RegionShift;
+    void *mem = __RT_ALTERNATIVE(mmap)(nullptr, total + RegionSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE,
+                                       -1, 0);
+    if (mem == MAP_FAILED) return; // every allocation falls back to the allocator underneath
+    base = (reinterpret_cast<uintptr_t>(mem) + RegionSize - 1) & ~(RegionSize - 1);
+    for (size_t r = 0; r < Regions; ++r)
+      regions[r].next = firstSlot(r);
+  }
+
+  __RT_PROTECT bool owns(uintptr_t ptr) const { return base && ptr - base < (Regions << RegionShift); }
+  __RT_PROTECT bool owns(const void *ptr) const { return owns(reinterpret_cast<uintptr_t>(ptr)); }
+
+  // Returns nullptr if the allocation doesn't fit a size class or the region is exhausted.
+  __RT_PROTECT void *allocate(size_t size, uint8_t type, size_t alignment = 1) {
+    if (!base || type >= Types || size > MaxSize || alignment > MaxSize) return nullptr;
+    const size_t region = type * Classes + classOf(size > alignment ? size : alignment), shift = shiftOf(region);
+    Region &r = regions[region];
+    size_t slot;
+    lock(r);
+    if (FreeSlot *free = r.free) {
+      r.free = free->next;
+      slot = (reinterpret_cast<uintptr_t>(free) - regionBase(region)) >> shift;
+    } else if (r.next < (RegionSize >> shift)) {
+      slot = r.next++;
+    } else {
+      unlock(r);
+      return nullptr;
+    }
+    __atomic_store_n(&sizes(region)[slot], static_cast<uint16_t>(size + 1), __ATOMIC_RELEASE);
+    unlock(r);
+    return reinterpret_cast<void *>(regionBase(region) + (slot << shift));
+  }
+
+  // Frees an owned slot; unknown, interior and already freed pointers are ignored.
+  __RT_PROTECT void release(const void *ptr) {
+    const auto addr = reinterpret_cast<uintptr_t>(ptr);
+    const size_t region = (addr - base) >> RegionShift, shift = shiftOf(region), slot = (addr - regionBase(region)) >> shift;
+    if (regionBase(region) + (slot << shift) != addr || slot < firstSlot(region)) return;
+    Region &r = regions[region];
+    lock(r);
+    if (sizes(region)[slot]) {
+      __atomic_store_n(&sizes(region)[slot], uint16_t{0}, __ATOMIC_RELEASE);
+      r.free = new (const_cast<void *>(ptr)) FreeSlot{r.free};
+    }
+    unlock(r);
+  }
+
+  // Updates the requested size in place if it still fits the slot's size class.
+  __RT_PROTECT bool resize(const void *ptr, size_t size) {
+    const auto addr = reinterpret_cast<uintptr_t>(ptr);
+    const size_t region = (addr - base) >> RegionShift;
+    if (size > MaxSize || classOf(size) != region % Classes) return false;
+    const size_t slot = (addr - regionBase(region)) >> shiftOf(region);
+    __atomic_store_n(&sizes(region)[slot], static_cast<uint16_t>(size + 1), __ATOMIC_RELEASE);
+    return true;
+  }
+
+  // Lock-free lookup of an owned address, including interior pointers. False for free slots and addresses past the requested size.
+  __RT_PROTECT bool query(uintptr_t addr, uintptr_t &start, size_t &size, uint8_t &type) const {
+    const size_t region = (addr - base) >> RegionShift, shift = shiftOf(region), slot = (addr - regionBase(region)) >> shift;
+    if (slot < firstSlot(region)) return false;
+    const uint16_t requested = __atomic_load_n(&sizes(region)[slot], __ATOMIC_ACQUIRE);
+    if (!requested) return false;
+    start = regionBase(region) + (slot << shift);
+    size = requested - 1u;
+    type = static_cast<uint8_t>(region / Classes);
+    return addr == start || addr - start < size;
+  }
+};
+
+__RT_PROTECT inline Arena &arena() {
+  static Arena instance;
+  return instance;
+}
+
+} // namespace ptr_reflect::details
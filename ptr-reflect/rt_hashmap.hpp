@@ -4,6 +4,7 @@
 #include <cstddef>
 
 #include "rt_protected.hpp"
+#include "rt_seqlock.hpp"
 
 namespace ptr_reflect::details {
 
@@ -22,6 +23,11 @@ template <typename K, typename V> class UnorderedMap {
     __RT_PROTECT Bucket() : head(nullptr) {}
   };
 
+  struct Retired {
+    Bucket *buckets;
+    Retired *next;
+  };
+
   using HashFunc = size_t (*)(const K &);
 
   static constexpr size_t MAX_BUCKETS = 1ULL << 30;
@@ -30,6 +36,22 @@ template <typename K, typename V> class UnorderedMap {
   float _loadFactor;
   HashFunc _hashFn;
   Bucket *_buckets;
+  // Erased nodes and replaced bucket arrays are kept mapped (and nodes reused) until destruction so that racy readers never fault.
+  Node *_freeNodes{};
+  Retired *_retired{};
+
+  __RT_PROTECT Node *allocNode(const K &key, const V &value) {
+    Node *node = _freeNodes;
+    if (node) _freeNodes = node->next;
+    else node = static_cast<Node *>(__RT_ALTERNATIVE(malloc)(sizeof(Node)));
+    return new (node) Node(key, value);
+  }
+
+  __RT_PROTECT void recycleNode(Node *node) {
+    node->~Node();
+    node->next = _freeNodes;
+    _freeNodes = node;
+  }
 
   __RT_PROTECT void rehash(size_t count) {
     count = (count < MAX_BUCKETS) ? count : MAX_BUCKETS;
@@ -46,7 +68,9 @@ template <typename K, typename V> class UnorderedMap {
         current = next;
       }
     }
-    __RT_ALTERNATIVE(free)(_buckets);
+    auto *retired = static_cast<Retired *>(__RT_ALTERNATIVE(malloc)(sizeof(Retired)));
+    *retired = Retired{_buckets, _retired};
+    _retired = retired;
     _buckets = newBuckets;
     _bucketCount = count;
   }
@@ -69,8 +93,7 @@ public:
       if (node->key == key) return false;
     }
 
-    Node *newNode = static_cast<Node *>(__RT_ALTERNATIVE(malloc)(sizeof(Node)));
-    new (newNode) Node(key, value);
+    Node *newNode = allocNode(key, value);
     newNode->next = _buckets[idx].head;
     _buckets[idx].head = newNode;
     ++_size;
@@ -85,6 +108,33 @@ public:
     return nullptr;
   }
 
+  // Lookup without the writer lock, for use under an external SeqLock. The value is copied out through `f`, which may observe a torn
+  // record; the caller must discard the result unless its SeqLock read validates. `valid` is polled on every hop so that a chain being
+  // relinked by a writer cannot trap the reader.
+  template <typename F, typename Valid> __RT_PROTECT bool findRacy(const K &key, F f, Valid valid) const {
+    Bucket *buckets = racyLoad(_buckets);
+    const size_t count = racyLoad(_bucketCount);
+    if (!valid()) return false;
+    for (Node *node = racyLoad(buckets[_hashFn(key) % count].head); node && valid(); node = racyLoad(node->next)) {
+      if (racyLoad(node->key) == key) {
+        f(node->key, node->value);
+        return true;
+      }
+    }
+    return false;
+  }
+
+  template <typename F, typename Valid> __RT_PROTECT bool walkRacy(F f, Valid valid) const {
+    Bucket *buckets = racyLoad(_buckets);
+    const size_t count = racyLoad(_bucketCount);
+    for (size_t idx = 0; idx < count && valid(); ++idx) {
+      for (Node *node = racyLoad(buckets[idx].head); node && valid(); node = racyLoad(node->next)) {
+        if (f(node->key, node->value)) return true;
+      }
+    }
+    return false;
+  }
+
   template <typename F> __RT_PROTECT void walk(F f) {
     for (size_t idx = 0; idx < _bucketCount; ++idx) {
       for (Node *node = _buckets[idx].head; node; node = node->next) {
@@ -93,6 +143,22 @@ public:
     }
   }
 
+  // Moves the entry under `from` to `to`, reusing its node. Fails if `from` is missing or `to` is already present.
+  __RT_PROTECT bool rekey(const K &from, const K &to) {
+    if (find(to)) return false;
+    for (Node **link = &_buckets[_hashFn(from) % _bucketCount].head; *link; link = &(*link)->next) {
+      if ((*link)->key != from) continue;
+      Node *node = *link;
+      *link = node->next;
+      node->key = to;
+      Bucket &target = _buckets[_hashFn(to) % _bucketCount];
+      node->next = target.head;
+      target.head = node;
+      return true;
+    }
+    return false;
+  }
+
   __RT_PROTECT bool erase(const K &key) {
     const size_t idx = _hashFn(key) % _bucketCount;
     Node *current = _buckets[idx].head;
@@ -101,8 +167,7 @@ public:
       if (current->key == key) {
         if (prev) prev->next = current->next;
         else _buckets[idx].head = current->next;
-        current->~Node();
-        __RT_ALTERNATIVE(free)(current);
+        recycleNode(current);
         --_size;
         return true;
       }
@@ -128,6 +193,17 @@ public:
 
   __RT_PROTECT ~UnorderedMap() {
     clear();
+    while (_freeNodes) {
+      Node *next = _freeNodes->next;
+      __RT_ALTERNATIVE(free)(_freeNodes);
+      _freeNodes = next;
+    }
+    while (_retired) {
+      Retired *next = _retired->next;
+      __RT_ALTERNATIVE(free)(_retired->buckets);
+      __RT_ALTERNATIVE(free)(_retired);
+      _retired = next;
+    }
     __RT_ALTERNATIVE(free)(_buckets);
   }
 
@@ -3,9 +3,28 @@
 #include <cstddef>
 #include <new>
 
+#if defined(__linux__) || defined(__APPLE__)
+  #include <sys/mman.h>
+#endif
+
 #include "rt_protected.hpp"
 #include "rt_reflect.hpp"
 
+#ifdef PTR_REFLECT_ARENA
+  #include <cstring>
+
+  #include "rt_arena.hpp"
+
+  // Small allocations are served from the arena and never reach the record table, see rt_arena.hpp.
+  #define __RT_ARENA_ALLOC(size, type, alignment)                                                                                        \
+    if (auto *arenaPtr = ::ptr_reflect::details::arena().allocate(size, ::ptr_reflect::to_integral(type), alignment)) return arenaPtr
+  #define __RT_ARENA_FREE(ptr)                                                                                                           \
+    if (::ptr_reflect::details::arena().owns(ptr)) return ::ptr_reflect::details::arena().release(ptr)
+#else
+  #define __RT_ARENA_ALLOC(size, type, alignment)
+  #define __RT_ARENA_FREE(ptr)
+#endif
+
 #define __ALLOC __RT_PROTECT [[clang::annotate("__rt_alloc")]] __attribute__((noinline))
 #define __FREE __RT_PROTECT [[clang::annotate("__rt_free")]]
 
@@ -18,42 +37,87 @@
 // NOLINTBEGIN(misc-definitions-in-headers)
 
 extern "C" __ALLOC void *malloc(size_t size) {
+  __RT_ARENA_ALLOC(size, ::ptr_reflect::_rt_Type::HeapMalloc, 1);
   auto ptr = __RT_ALTERNATIVE(malloc)(size);
   ::ptr_reflect::_rt_record(ptr, size, ::ptr_reflect::_rt_Type::HeapMalloc);
   return ptr;
 }
 
 extern "C" __ALLOC void *calloc(size_t nmemb, size_t size) {
+#ifdef PTR_REFLECT_ARENA
+  if (nmemb && size <= ::ptr_reflect::details::Arena::MaxSize / nmemb) {
+    auto ptr = ::ptr_reflect::details::arena().allocate(nmemb * size, ::ptr_reflect::to_integral(::ptr_reflect::_rt_Type::HeapCalloc));
+    if (ptr) return std::memset(ptr, 0, nmemb * size); // slots are recycled
+  }
+#endif
   auto ptr = __RT_ALTERNATIVE(calloc)(nmemb, size);
-  ::ptr_reflect::_rt_record(ptr, size, ::ptr_reflect::_rt_Type::HeapCalloc);
+  ::ptr_reflect::_rt_record(ptr, nmemb * size, ::ptr_reflect::_rt_Type::HeapCalloc); // calloc fails on overflow
   return ptr;
 }
 
 extern "C" __ALLOC void *realloc(void *ptr, size_t size) {
-  if (ptr) ::ptr_reflect::_rt_release(ptr, ::ptr_reflect::_rt_Type::HeapFree);
+#ifdef PTR_REFLECT_ARENA
+  auto &arena = ::ptr_reflect::details::arena();
+  if (!ptr) __RT_ARENA_ALLOC(size, ::ptr_reflect::_rt_Type::HeapRealloc, 1);
+  if (arena.owns(ptr)) {
+    if (arena.resize(ptr, size)) return ptr;
+    uintptr_t start;
+    size_t old;
+    uint8_t type;
+    if (!arena.query(reinterpret_cast<uintptr_t>(ptr), start, old, type)) return nullptr; // not a live slot
+    auto moved = realloc(nullptr, size);
+    if (!moved) return nullptr;
+    std::memcpy(moved, ptr, old < size ? old : size);
+    arena.release(ptr);
+    return moved;
+  }
+#endif
+  if (ptr) return ::ptr_reflect::_rt_resize(ptr, size, __RT_ALTERNATIVE(realloc));
   auto ptr1 = __RT_ALTERNATIVE(realloc)(ptr, size);
   ::ptr_reflect::_rt_record(ptr1, size, ::ptr_reflect::_rt_Type::HeapRealloc);
   return ptr1;
 }
 
 extern "C" __ALLOC void *memalign(size_t alignment, size_t size) {
+  __RT_ARENA_ALLOC(size, ::ptr_reflect::_rt_Type::HeapMemalign, alignment);
   auto ptr = __RT_ALTERNATIVE(memalign)(alignment, size);
   ::ptr_reflect::_rt_record(ptr, size, ::ptr_reflect::_rt_Type::HeapMemalign);
   return ptr;
 }
 
 extern "C" __ALLOC void *aligned_alloc(size_t alignment, size_t size) {
+  __RT_ARENA_ALLOC(size, ::ptr_reflect::_rt_Type::HeapAlignedAlloc, alignment);
   auto ptr = __RT_ALTERNATIVE(memalign)(alignment, size);
   ::ptr_reflect::_rt_record(ptr, size, ::ptr_reflect::_rt_Type::HeapAlignedAlloc);
   return ptr;
 }
 
 extern "C" __FREE void free(void *ptr) {
+  __RT_ARENA_FREE(ptr);
   (__RT_ALTERNATIVE(free)(ptr));
   ::ptr_reflect::_rt_release(ptr, ::ptr_reflect::_rt_Type::HeapFree);
 }
 
+#if defined(__linux__) || defined(__APPLE__)
+
+// Mappings are tracked from their start: a munmap covering the whole mapping releases it, one covering its head shrinks the record to what
+// is left, and unmapping a tail or a hole in the middle leaves the record of the original mapping in place.
+extern "C" __ALLOC void *mmap(void *addr, size_t length, int prot, int flags, int fd, off_t offset) {
+  auto ptr = __RT_ALTERNATIVE(mmap)(addr, length, prot, flags, fd, offset);
+  if (ptr != MAP_FAILED) ::ptr_reflect::_rt_record(ptr, length, ::ptr_reflect::_rt_Type::MMap);
+  return ptr;
+}
+
+extern "C" __FREE int munmap(void *addr, size_t length) {
+  static const size_t page = sysconf(_SC_PAGESIZE);
+  ::ptr_reflect::_rt_unmap(addr, (length + page - 1) / page * page); // the kernel unmaps whole pages
+  return __RT_ALTERNATIVE(munmap)(addr, length);
+}
+
+#endif
+
 __ALLOC void *operator new(size_t size) {
+  __RT_ARENA_ALLOC(size, ::ptr_reflect::_rt_Type::HeapCXXNew, 1);
   auto *ptr = __RT_ALTERNATIVE(malloc)(size);
   if (!ptr) __THROW_OF_ABORT(std::bad_alloc{});
   ::ptr_reflect::_rt_record(ptr, size, ::ptr_reflect::_rt_Type::HeapCXXNew);
@@ -61,6 +125,7 @@ __ALLOC void *operator new(size_t size) {
 }
 
 __ALLOC void *operator new(size_t size, std::align_val_t a) {
+  __RT_ARENA_ALLOC(size, ::ptr_reflect::_rt_Type::HeapCXXNew, static_cast<size_t>(a));
   auto *ptr = __RT_ALTERNATIVE(memalign)(static_cast<size_t>(a), size);
   if (!ptr) __THROW_OF_ABORT(std::bad_alloc{});
   ::ptr_reflect::_rt_record(ptr, size, ::ptr_reflect::_rt_Type::HeapCXXNew);
@@ -68,18 +133,21 @@ __ALLOC void *operator new(size_t size, std::align_val_t a) {
 }
 
 __ALLOC void *operator new(size_t size, const std::nothrow_t &) noexcept {
+  __RT_ARENA_ALLOC(size, ::ptr_reflect::_rt_Type::HeapCXXNew, 1);
   auto ptr = __RT_ALTERNATIVE(malloc)(size);
   ::ptr_reflect::_rt_record(ptr, size, ::ptr_reflect::_rt_Type::HeapCXXNew);
   return ptr;
 }
 
 __ALLOC void *operator new(size_t size, std::align_val_t a, const std::nothrow_t &) noexcept {
+  __RT_ARENA_ALLOC(size, ::ptr_reflect::_rt_Type::HeapCXXNew, static_cast<size_t>(a));
   auto ptr = __RT_ALTERNATIVE(malloc)(size);
   ::ptr_reflect::_rt_record(ptr, size, ::ptr_reflect::_rt_Type::HeapCXXNew);
   return ptr;
 }
 
 __ALLOC void *operator new[](size_t size) {
+  __RT_ARENA_ALLOC(size, ::ptr_reflect::_rt_Type::HeapCXXNew, 1);
   auto *ptr = __RT_ALTERNATIVE(malloc)(size);
   if (!ptr) __THROW_OF_ABORT(std::bad_alloc{});
   ::ptr_reflect::_rt_record(ptr, size, ::ptr_reflect::_rt_Type::HeapCXXNew);
@@ -87,6 +155,7 @@ __ALLOC void *operator new[](size_t size) {
 }
 
 __ALLOC void *operator new[](size_t size, std::align_val_t a) {
+  __RT_ARENA_ALLOC(size, ::ptr_reflect::_rt_Type::HeapCXXNew, static_cast<size_t>(a));
   auto *ptr = __RT_ALTERNATIVE(memalign)(static_cast<size_t>(a), size);
   if (!ptr) __THROW_OF_ABORT(std::bad_alloc{});
   ::ptr_reflect::_rt_record(ptr, size, ::ptr_reflect::_rt_Type::HeapCXXNew);
@@ -94,62 +163,76 @@ __ALLOC void *operator new[](size_t size, std::align_val_t a) {
 }
 
 __ALLOC void *operator new[](size_t size, const std::nothrow_t &) noexcept {
+  __RT_ARENA_ALLOC(size, ::ptr_reflect::_rt_Type::HeapCXXNew, 1);
   auto ptr = __RT_ALTERNATIVE(malloc)(size);
   ::ptr_reflect::_rt_record(ptr, size, ::ptr_reflect::_rt_Type::HeapCXXNew);
   return ptr;
 }
 
 __ALLOC void *operator new[](size_t size, std::align_val_t a, const std::nothrow_t &) noexcept {
+  __RT_ARENA_ALLOC(size, ::ptr_reflect::_rt_Type::HeapCXXNew, static_cast<size_t>(a));
   auto ptr = __RT_ALTERNATIVE(memalign)(static_cast<size_t>(a), size);
   ::ptr_reflect::_rt_record(ptr, size, ::ptr_reflect::_rt_Type::HeapCXXNew);
   return ptr;
 }
 
 __FREE void operator delete(void *ptr) noexcept {
+  __RT_ARENA_FREE(ptr);
   ::ptr_reflect::_rt_release(ptr, ::ptr_reflect::_rt_Type::HeapCXXDelete);
   (__RT_ALTERNATIVE(free)(ptr));
 }
 __FREE void operator delete[](void *ptr) noexcept {
+  __RT_ARENA_FREE(ptr);
   ::ptr_reflect::_rt_release(ptr, ::ptr_reflect::_rt_Type::HeapCXXDelete);
   (__RT_ALTERNATIVE(free)(ptr));
 }
 __FREE void operator delete(void *ptr, std::align_val_t) noexcept {
+  __RT_ARENA_FREE(ptr);
   ::ptr_reflect::_rt_release(ptr, ::ptr_reflect::_rt_Type::HeapCXXDelete);
   (__RT_ALTERNATIVE(free)(ptr));
 }
 __FREE void operator delete[](void *ptr, std::align_val_t) noexcept {
+  __RT_ARENA_FREE(ptr);
   ::ptr_reflect::_rt_release(ptr, ::ptr_reflect::_rt_Type::HeapCXXDelete);
   (__RT_ALTERNATIVE(free)(ptr));
 }
 __FREE void operator delete(void *ptr, size_t) noexcept {
+  __RT_ARENA_FREE(ptr);
   ::ptr_reflect::_rt_release(ptr, ::ptr_reflect::_rt_Type::HeapCXXDelete);
   (__RT_ALTERNATIVE(free)(ptr));
 }
 __FREE void operator delete[](void *ptr, size_t) noexcept {
+  __RT_ARENA_FREE(ptr);
   ::ptr_reflect::_rt_release(ptr, ::ptr_reflect::_rt_Type::HeapCXXDelete);
   (__RT_ALTERNATIVE(free)(ptr));
 }
 __FREE void operator delete(void *ptr, size_t, std::align_val_t) noexcept {
+  __RT_ARENA_FREE(ptr);
   ::ptr_reflect::_rt_release(ptr, ::ptr_reflect::_rt_Type::HeapCXXDelete);
   (__RT_ALTERNATIVE(free)(ptr));
 }
 __FREE void operator delete[](void *ptr, size_t, std::align_val_t) noexcept {
+  __RT_ARENA_FREE(ptr);
   ::ptr_reflect::_rt_release(ptr, ::ptr_reflect::_rt_Type::HeapCXXDelete);
   (__RT_ALTERNATIVE(free)(ptr));
 }
 __FREE void operator delete(void *ptr, const std::nothrow_t &) noexcept {
+  __RT_ARENA_FREE(ptr);
   ::ptr_reflect::_rt_release(ptr, ::ptr_reflect::_rt_Type::HeapCXXDelete);
   (__RT_ALTERNATIVE(free)(ptr));
 }
 __FREE void operator delete[](void *ptr, const std::nothrow_t &) noexcept {
+  __RT_ARENA_FREE(ptr);
   ::ptr_reflect::_rt_release(ptr, ::ptr_reflect::_rt_Type::HeapCXXDelete);
   (__RT_ALTERNATIVE(free)(ptr));
 }
 __FREE void operator delete(void *ptr, std::align_val_t, const std::nothrow_t &) noexcept {
+  __RT_ARENA_FREE(ptr);
   ::ptr_reflect::_rt_release(ptr, ::ptr_reflect::_rt_Type::HeapCXXDelete);
   (__RT_ALTERNATIVE(free)(ptr));
 }
 __FREE void operator delete[](void *ptr, std::align_val_t, const std::nothrow_t &) noexcept {
+  __RT_ARENA_FREE(ptr);
   ::ptr_reflect::_rt_release(ptr, ::ptr_reflect::_rt_Type::HeapCXXDelete);
   (__RT_ALTERNATIVE(free)(ptr));
 }
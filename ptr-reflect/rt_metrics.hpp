@@ -0,0 +1,145 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <new>
+
+#ifndef _WIN32
+  #include <fcntl.h>
+  #include <sys/mman.h>
+  #include <unistd.h>
+#endif
+
+#include "rt_protected.hpp"
+#include "rt_seqlock.hpp"
+
+namespace ptr_reflect {
+
+// Counters published to the named shared-memory segment /dev/shm/ptr_reflect_<pid>. Plain data so a reader can copy a snapshot out.
+struct MetricsCounters {
+  static constexpr size_t Types = 16; // indexed by to_integral(_rt_Type)
+
+  struct PerType {
+    uint64_t liveBytes, liveCount;
+    uint64_t allocs, allocBytes, frees;
+  };
+
+  uint64_t updatedNs; // steady_clock, same epoch as startNs
+  PerType types[Types];
+  uint64_t tableSize, tableBuckets;
+  uint64_t traceEvents, traceBacklog; // events written, and events not yet flushed to the trace file
+};
+
+// Layout of the shared-memory segment. Bump Version on any change to this struct or MetricsCounters.
+struct MetricsPage {
+  static constexpr uint64_t Magic = 0x746365666c657270; // "preflect"
+  static constexpr uint32_t Version = 1;
+
+  uint64_t magic;
+  uint32_t version, size;
+  int64_t pid;
+  uint64_t startNs;
+  details::SeqLock seq;
+  MetricsCounters counters;
+};
+
+inline void metricsSegmentName(char (&buffer)[64], long pid) { std::snprintf(buffer, sizeof(buffer), "/ptr_reflect_%ld", pid); }
+
+namespace details {
+
+// Writer side: the segment is created and mapped once at startup; updates are plain stores under the page's SeqLock (callers already
+// hold the service's writer lock), so the allocation path never issues a syscall.
+class MetricsExport {
+  MetricsPage *page{};
+  char name[64]{};
+
+  template <typename F> __RT_PROTECT void update(uint64_t nowNs, F f) {
+    if (!page) return;
+    SeqLock::WriteGuard guard(page->seq);
+    page->counters.updatedNs = nowNs;
+    f(page->counters);
+  }
+
+public:
+  __RT_PROTECT bool open(long pid, uint64_t startNs) {
+#ifndef _WIN32
+    metricsSegmentName(name, pid);
+    int fd = shm_open(name, O_CREAT | O_RDWR | O_TRUNC, 0600); // counters are only for the owner
+    if (fd < 0) return false;
+    if (ftruncate(fd, sizeof(MetricsPage)) != 0) {
+      ::close(fd);
+      shm_unlink(name);
+      return false;
+    }
+    void *mem = __RT_ALTERNATIVE(mmap)(nullptr, sizeof(MetricsPage), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    ::close(fd);
+    if (mem == MAP_FAILED) {
+      shm_unlink(name);
+      return false;
+    }
+    std::memset(mem, 0, sizeof(MetricsPage));
+    page = new (mem) MetricsPage{};
+    page->version = MetricsPage::Version;
+    page->size = sizeof(MetricsPage);
+    page->pid = pid;
+    page->startNs = startNs;
+    std::atomic_thread_fence(std::memory_order_release);
+    page->magic = MetricsPage::Magic; // published last, readers check it before anything else
+    return true;
+#else
+    return false;
+#endif
+  }
+
+  __RT_PROTECT void close() {
+#ifndef _WIN32
+    if (!page) return;
+    __RT_ALTERNATIVE(munmap)(page, sizeof(MetricsPage));
+    shm_unlink(name);
+    page = nullptr;
+#endif
+  }
+
+  __RT_PROTECT void record(uint64_t nowNs, uint8_t type, size_t size, size_t tableSize, size_t tableBuckets) {
+    update(nowNs, [&](MetricsCounters &c) {
+      auto &t = c.types[type % MetricsCounters::Types];
+      t.liveBytes += size;
+      t.liveCount++;
+      t.allocs++;
+      t.allocBytes += size;
+      c.tableSize = tableSize;
+      c.tableBuckets = tableBuckets;
+    });
+  }
+
+  __RT_PROTECT void release(uint64_t nowNs, uint8_t type, size_t size, size_t tableSize, size_t tableBuckets) {
+    update(nowNs, [&](MetricsCounters &c) {
+      auto &t = c.types[type % MetricsCounters::Types];
+      t.liveBytes -= size;
+      t.liveCount--;
+      t.frees++;
+      c.tableSize = tableSize;
+      c.tableBuckets = tableBuckets;
+    });
+  }
+
+  // In-place or moving realloc: only the live size changes, the allocation is neither new nor freed.
+  __RT_PROTECT void resize(uint64_t nowNs, uint8_t type, size_t from, size_t to) {
+    update(nowNs, [&](MetricsCounters &c) {
+      auto &t = c.types[type % MetricsCounters::Types];
+      t.liveBytes += to - from;
+    });
+  }
+
+  __RT_PROTECT void trace(uint64_t nowNs, uint64_t events, uint64_t backlog) {
+    update(nowNs, [&](MetricsCounters &c) {
+      c.traceEvents = events;
+      c.traceBacklog = backlog;
+    });
+  }
+};
+
+} // namespace details
+} // namespace ptr_reflect
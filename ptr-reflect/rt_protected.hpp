@@ -4,6 +4,7 @@
 
 #if defined(__linux__) || defined(__APPLE__)
   #include <dlfcn.h>
+  #include <sys/types.h>
 #endif
 
 #define __RT_PROTECT [[clang::annotate("__rt_protect")]]
@@ -43,6 +44,16 @@ extern "C" inline void __interposed_free(void *ptr) {
  _free(ptr);
 }
 
+extern "C" inline void *__interposed_mmap(void *addr, size_t length, int prot, int flags, int fd, off_t offset) {
+  static __DEF_DLSYM(mmap, void *, void *, size_t, int, int, int, off_t);
+  return _mmap(addr, length, prot, flags, fd, offset);
+}
+
+extern "C" inline int __interposed_munmap(void *addr, size_t length) {
+  static __DEF_DLSYM(munmap, int, void *, size_t);
+  return _munmap(addr, length);
+}
+
 #endif
 
 // extern "C" void *__libc_malloc(size_t size);
@@ -56,5 +67,7 @@ extern "C" __attribute__((weak)) void *__interceptor_calloc(size_t nmemb, size_t
 extern "C" __attribute__((weak)) void *__interceptor_realloc(void *ptr, size_t size);
 extern "C" __attribute__((weak)) void *__interceptor_memalign(size_t alignment, size_t size);
 extern "C" __attribute__((weak)) void __interceptor_free(void *ptr);
+extern "C" __attribute__((weak)) void *__interceptor_mmap(void *addr, size_t length, int prot, int flags, int fd, off_t offset);
+extern "C" __attribute__((weak)) int __interceptor_munmap(void *addr, size_t length);
 
 #define __RT_ALTERNATIVE(func) (__interceptor_##func ? __interceptor_##func : __interposed_##func)
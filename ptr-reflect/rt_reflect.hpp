@@ -4,18 +4,24 @@
 #include <cstdarg>
 #include <cstddef>
 #include <cstdint>
+#include <cstdio>
+#include <optional>
 #include <type_traits>
 
 #ifdef __RT_IMPL
+  #include <algorithm>
   #include <atomic>
   #include <chrono>
-  #include <cstdio>
   #include <cstdlib>
   #include <mutex>
-  #include <shared_mutex>
 
+  #ifdef PTR_REFLECT_ARENA
+    #include "rt_arena.hpp"
+  #endif
   #include "rt_hashmap.hpp"
+  #include "rt_metrics.hpp"
   #include "rt_protected.hpp"
+  #include "rt_seqlock.hpp"
 
   #ifdef _WIN32
     #include <windows.h>
@@ -43,6 +49,13 @@ extern "C" enum class _rt_Type : uint8_t {
   HeapFree,
   HeapCXXNew,
   HeapCXXDelete,
+
+  HeapCustom,
+  HeapCustomFree,
+  MMap,
+  MUnmap,
+
+  Global, // only produced by queries the plugin folded at compile time, globals are not tracked at runtime
 };
 
 extern "C" struct _rt_PtrInfo {
@@ -51,6 +64,13 @@ extern "C" struct _rt_PtrInfo {
   _rt_Type type;
 };
 
+// Annotations for user-defined allocators, picked up by the plugin: the pointer returned by an `__RT_ALLOCATOR(n)` function is recorded
+// with the size passed in argument n, and the pointer in argument n of an `__RT_DEALLOCATOR(n)` function is released on entry.
+// For example `__RT_ALLOCATOR(1) void *poolAlloc(Pool *pool, size_t size);` and `__RT_DEALLOCATOR(1) void poolFree(Pool *, void *);`
+// The bodies are instrumented after inlining, so both are kept out of line or an inlined copy would go unrecorded.
+#define __RT_ALLOCATOR(sizeArg) [[clang::annotate("__rt_alloc", sizeArg)]] __attribute__((noinline))
+#define __RT_DEALLOCATOR(ptrArg) [[clang::annotate("__rt_free", ptrArg)]] __attribute__((noinline))
+
 template <typename E> constexpr typename std::underlying_type<E>::type to_integral(E e) {
   return static_cast<typename std::underlying_type<E>::type>(e);
 }
@@ -68,12 +88,20 @@ constexpr const char *to_string(_rt_Type t) {
     case _rt_Type::HeapFree: return "HeapFree";
     case _rt_Type::HeapCXXNew: return "HeapCXXNew";
     case _rt_Type::HeapCXXDelete: return "HeapCXXDelete";
+
+    case _rt_Type::HeapCustom: return "HeapCustom";
+    case _rt_Type::HeapCustomFree: return "HeapCustomFree";
+    case _rt_Type::MMap: return "MMap";
+    case _rt_Type::MUnmap: return "MUnmap";
+
+    case _rt_Type::Global: return "Global";
   }
   return "Unknown";
 }
 
-_rt_PtrInfo *query(void *ptr);
-size_t *querySize(void *ptr);
+std::optional<_rt_PtrInfo> reflect(void *ptr);
+std::optional<size_t> reflectSize(void *ptr);
+void dumpLifetimes(std::FILE *out);
 
 #ifdef __RT_IMPL
 
@@ -129,6 +157,107 @@ __RT_PROTECT void fail() {
 struct PtrRecord {
   time_point<steady_clock> point;
   _rt_PtrInfo info;
+  uint32_t tid; // allocating thread, see threadId()
+  uint64_t id;  // stable across resizes, links resize events to the final trace event
+};
+
+// Small sequential thread ids for the trace, cheaper than a gettid() syscall per allocation.
+__RT_PROTECT inline uint32_t threadId() {
+  static std::atomic<uint32_t> next{1};
+  thread_local uint32_t id = next.fetch_add(1, std::memory_order_relaxed);
+  return id;
+}
+
+__RT_PROTECT inline size_t log2Floor(uint64_t x) { return x ? 63 - __builtin_clzll(x) : 0; }
+
+__RT_PROTECT inline void formatNs(char (&buffer)[16], double ns) {
+  if (ns < 1e3) std::snprintf(buffer, sizeof(buffer), "%.0fns", ns);
+  else if (ns < 1e6) std::snprintf(buffer, sizeof(buffer), "%.1fus", ns / 1e3);
+  else if (ns < 1e9) std::snprintf(buffer, sizeof(buffer), "%.1fms", ns / 1e6);
+  else std::snprintf(buffer, sizeof(buffer), "%.1fs", ns / 1e9);
+}
+
+// Online allocation lifetime aggregation, kept per allocation type and per (heap) size class so that no trace has to be stored or
+// post-processed to find candidates for arenas, pools or stack promotion. Not thread-safe, callers hold the writer lock.
+class LifetimeStats {
+public:
+  static constexpr size_t Buckets = 40;     // log2(ns), the last bucket absorbs everything above ~9 minutes
+  static constexpr size_t SizeClasses = 48; // log2(bytes)
+  static constexpr size_t Types = 16;
+
+  struct Histogram {
+    uint64_t count, shortLived, bytes;
+    double totalNs;
+    uint64_t buckets[Buckets];
+
+    __RT_PROTECT void add(size_t size, uint64_t ns, bool isShort) {
+      count++;
+      shortLived += isShort;
+      bytes += size;
+      totalNs += static_cast<double>(ns);
+      const size_t bucket = log2Floor(ns);
+      buckets[bucket < Buckets ? bucket : Buckets - 1]++;
+    }
+
+    // Upper bound of the bucket holding the given quantile.
+    __RT_PROTECT [[nodiscard]] double quantileNs(double q) const {
+      uint64_t seen = 0;
+      for (size_t i = 0; i < Buckets; ++i) {
+        seen += buckets[i];
+        if (static_cast<double>(seen) >= q * static_cast<double>(count)) return static_cast<double>(2ULL << i);
+      }
+      return static_cast<double>(2ULL << (Buckets - 1));
+    }
+
+    __RT_PROTECT void dump(std::FILE *out, const char *label) const {
+      if (!count) return;
+      char mean[16], p50[16], p99[16];
+      formatNs(mean, totalNs / static_cast<double>(count));
+      formatNs(p50, quantileNs(0.5));
+      formatNs(p99, quantileNs(0.99));
+      safe_fprintf(out,
+                   "[PtrReflect]   %-20s n=%-10" PRIu64 " short=%-10" PRIu64 " (%5.1f%%) bytes=%-12" PRIu64 " mean=%-8s p50<%-8s p99<%-8s|",
+                   label, count, shortLived, 100.0 * static_cast<double>(shortLived) / static_cast<double>(count), bytes, mean, p50, p99);
+      for (size_t i = 0; i < Buckets; ++i)
+        if (buckets[i]) safe_fprintf(out, " %zu:%" PRIu64, i, buckets[i]);
+      safe_fprintf(out, "\n");
+    }
+  };
+
+private:
+  Histogram byType[Types]{};
+  Histogram bySize[SizeClasses]{};
+  uint64_t shortLivedNs;
+
+public:
+  __RT_PROTECT explicit LifetimeStats(uint64_t shortLivedNs) : shortLivedNs(shortLivedNs) {}
+
+  __RT_PROTECT void add(const _rt_PtrInfo &info, uint64_t ns) {
+    const bool isShort = ns < shortLivedNs;
+    byType[to_integral(info.type) % Types].add(info.size, ns, isShort);
+    if (info.type != _rt_Type::StackAlloc) {
+      const size_t sizeClass = log2Floor(info.size);
+      bySize[sizeClass < SizeClasses ? sizeClass : SizeClasses - 1].add(info.size, ns, isShort);
+    }
+  }
+
+  __RT_PROTECT void dump(std::FILE *out) const {
+    uint64_t count = 0, shortLived = 0;
+    for (const auto &h : byType) {
+      count += h.count;
+      shortLived += h.shortLived;
+    }
+    safe_fprintf(out,
+                 "[PtrReflect] lifetimes: %" PRIu64 " released, %" PRIu64 " short-lived (<%" PRIu64 "ns), histogram is log2(ns):count\n", //
+                 count, shortLived, shortLivedNs);
+    for (size_t t = 0; t < Types; ++t)
+      byType[t].dump(out, to_string(static_cast<_rt_Type>(t)));
+    char label[32];
+    for (size_t c = 0; c < SizeClasses; ++c) {
+      std::snprintf(label, sizeof(label), "heap [2^%zu,2^%zu)", c, c + 1);
+      bySize[c].dump(out, label);
+    }
+  }
 };
 
 class ReflectService {
@@ -146,87 +275,259 @@ class ReflectService {
 
   std::atomic_bool &interpose;
   UnorderedMap<uintptr_t, PtrRecord> data;
-  std::shared_mutex mutex{};
+  // Sub-allocations from annotated custom allocators. These normally live inside a block already recorded in `data` (often at its very
+  // base), so they are indexed separately and take precedence on lookup.
+  UnorderedMap<uintptr_t, PtrRecord> nested;
+  // Old addresses of the reallocs running outside of `mutex`, see blockingResize. Their records stay in `data` until the resize lands,
+  // unless the address is claimed again in the meantime: the record is then parked here so the resize can still carry it over.
+  UnorderedMap<uintptr_t, std::optional<PtrRecord>> resizing;
+  mutable std::mutex mutex{}; // serialises writers, readers go through `version` and only take it once optimistic() gives up
+  SeqLock version{};
   time_point<steady_clock> start;
   std::FILE *trace{};
+  uint64_t traceEvents{}, traceBacklog{};
+  uint64_t nextId{};
+  LifetimeStats lifetimes;
+  MetricsExport metrics;
+
+  static constexpr size_t OptimisticAttempts = 8;
 
-  __RT_PROTECT PtrRecord *queryUnsafe(uintptr_t ptr, bool allowSubrange) {
-    PtrRecord *result = data.find(ptr);
-    if (result) return result;
-    if (allowSubrange) {
-      data.walk([&](uintptr_t, PtrRecord *value) {
-        if (ptr >= value->info.ptr && ptr < value->info.ptr + value->info.size) {
-          result = value;
-          return true;
-        }
-        return false;
-      });
-      return result;
+  __RT_PROTECT static uint64_t ns(time_point<steady_clock> point) { return duration_cast<nanoseconds>(point.time_since_epoch()).count(); }
+
+  __RT_PROTECT UnorderedMap<uintptr_t, PtrRecord> &tableFor(_rt_Type type) {
+    return type == _rt_Type::HeapCustom || type == _rt_Type::HeapCustomFree ? nested : data;
+  }
+
+  template <typename Valid> __RT_PROTECT bool queryRacy(uintptr_t ptr, _rt_PtrInfo &out, Valid valid) const {
+    const auto copy = [&](uintptr_t, const PtrRecord &value) { out = value.info; };
+    if (nested.findRacy(ptr, copy, valid) || data.findRacy(ptr, copy, valid)) return true;
+    const auto contains = [&](uintptr_t, const PtrRecord &value) {
+      const _rt_PtrInfo info = value.info;
+      if (ptr >= info.ptr && ptr < info.ptr + info.size) {
+        out = info;
+        return true;
+      }
+      return false;
+    };
+    return nested.walkRacy(contains, valid) || data.walkRacy(contains, valid);
+  }
+
+  // Retries f(valid) until it ran without overlapping a write; f must only read through the racy accessors. A long scan can keep losing
+  // to a steady stream of writers, so after a few attempts f runs once more under `mutex`, where nothing can move underneath it: reads
+  // are only lock-free while writes leave them room, and the fallback stalls writers for as long as f runs.
+  template <typename F> __RT_PROTECT bool optimistic(F f) const {
+    for (size_t attempt = 0; attempt < OptimisticAttempts; ++attempt) {
+      const uint64_t seq = version.readBegin();
+      const auto valid = [&]() { return version.readValid(seq); };
+      const bool found = f(valid);
+      if (valid()) return found;
+      SeqLock::pause();
     }
-    return nullptr;
+    std::unique_lock lock(mutex);
+    return f([]() { return true; });
+  }
+
+  __RT_PROTECT void publishRecord(const _rt_PtrInfo &info, time_point<steady_clock> now) {
+    metrics.record(ns(now), to_integral(info.type), info.size, data.size() + nested.size(), data.bucket_count() + nested.bucket_count());
+  }
+
+  // Writers below expect `mutex` to be held.
+
+  __RT_PROTECT void recordLocked(const _rt_PtrInfo &info, const time_point<steady_clock> now) {
+    // safe_fprintf(stderr, "[PtrReflect] record %p(size=%ld, type=%s)\n", reinterpret_cast<void *>(info.ptr), info.size,
+    //              to_string(info.type));
+
+    auto &table = tableFor(info.type);
+    if (&table == &data) displaceLocked(info.ptr);
+    if (info.type == _rt_Type::MMap && table.find(info.ptr)) // MAP_FIXED over an existing mapping ends it
+      releaseLocked(info.ptr, _rt_Type::MUnmap, now);
+    SeqLock::WriteGuard guard(version);
+    const auto inserted = table.emplace(info.ptr, PtrRecord{now, info, threadId(), nextId});
+    if (!inserted) {
+      safe_fprintf(stderr, "[PtrReflect] failed to insert %p (size=%ld, type=%s)\n", reinterpret_cast<void *>(info.ptr), info.size,
+                   to_string(info.type));
+      fail();
+    }
+    nextId++;
+    publishRecord(info, now);
+  }
+
+  // Parks the record at `ptr` if it belongs to a resize in flight whose realloc has already freed that address.
+  __RT_PROTECT void displaceLocked(uintptr_t ptr) {
+    auto *pending = resizing.find(ptr);
+    if (!pending || *pending) return;
+    if (const PtrRecord *record = data.find(ptr)) {
+      *pending = *record;
+      SeqLock::WriteGuard guard(version);
+      data.erase(ptr);
+    }
+  }
+
+  __RT_PROTECT void traced(const time_point<steady_clock> now) {
+    traceEvents++;
+    if (++traceBacklog == 100) {
+      std::fflush(trace);
+      traceBacklog = 0;
+    }
+    metrics.trace(ns(now), traceEvents, traceBacklog);
+  }
+
+  __RT_PROTECT void releaseLocked(uintptr_t ptr, _rt_Type type, const time_point<steady_clock> now) {
+    // safe_fprintf(stderr, "[PtrReflect] release %p (type=%s)\n", reinterpret_cast<void *>(ptr), to_string(type));
+    auto &table = tableFor(type);
+    if (auto it = table.find(ptr)) {
+      const PtrRecord record = *it;
+      {
+        SeqLock::WriteGuard guard(version);
+        table.erase(ptr);
+      }
+      retireLocked(record, now);
+      return;
+    }
+    if (type == _rt_Type::MUnmap) return; // mappings made before startup or partial unmaps are expected
+    safe_fprintf(stderr, "[PtrReflect] failed to release %p (type=%s)\n", reinterpret_cast<void *>(ptr), to_string(type));
+    // raise(SIGTRAP);
+    // fail();
+  }
+
+  // Traces a record that kept its id while its block moved or changed size, as an instant resize event.
+  __RT_PROTECT void resizedLocked(const _rt_PtrInfo &before, const _rt_PtrInfo &after, uint64_t id, const time_point<steady_clock> now) {
+    safe_fprintf(trace,
+                 "  {"
+                 "\"name\": \"0x%lx -> 0x%lx (%ld -> %ld)\","
+                 "\"cat\": \"%s\", "
+                 "\"ph\": \"i\", \"s\": \"t\", "
+                 "\"ts\": %" PRId64 ", "
+                 "\"pid\": %d, \"tid\": %d, \"args\": {\"id\": %" PRIu64 "}},\n",
+                 before.ptr, after.ptr, before.size, after.size, to_string(before.type),                //
+                 duration_cast<microseconds>(now.time_since_epoch()).count(), to_integral(before.type), //
+                 threadId(), id);
+    metrics.resize(ns(now), to_integral(before.type), before.size, after.size);
+    traced(now);
+  }
+
+  // Traces and accounts for a record that has already been taken out of its table.
+  __RT_PROTECT void retireLocked(const PtrRecord &record, const time_point<steady_clock> now) {
+    const auto [recordPoint, info, tid, id] = record;
+    safe_fprintf(trace,
+                 "  {"
+                 "\"name\": \"0x%lx (%ld)\","
+                 "\"cat\": \"%s\", "
+                 "\"ph\": \"X\", "
+                 "\"ts\": %" PRId64 " , "
+                 "\"dur\": %" PRId64 ", \"pid\": %d, \"tid\": %d, \"args\": {\"id\": %" PRIu64 "}},\n",
+                 info.ptr, info.size, to_string(info.type),                                      //
+                 duration_cast<microseconds>(recordPoint.time_since_epoch()).count(),            //
+                 duration_cast<microseconds>(now - recordPoint).count(), to_integral(info.type), //
+                 tid, id);
+    lifetimes.add(info, duration_cast<nanoseconds>(now - recordPoint).count());
+    metrics.release(ns(now), to_integral(info.type), info.size, data.size() + nested.size(), data.bucket_count() + nested.bucket_count());
+    traced(now);
   }
 
 public:
   __RT_PROTECT ReflectService(std::atomic_bool &interpose)
-      : interpose(interpose), data([](auto x) { return x; }), start(steady_clock::now()) {
-    char *name{};
-    safe_snprintf(&name, "trace_%d.json",
+      : interpose(interpose), data([](auto x) { return x; }), nested([](auto x) { return x; }, 0.75f, 64),
+        resizing([](auto x) { return x; }, 0.75f, 16), start(steady_clock::now()),
+        lifetimes(std::getenv("PTR_REFLECT_SHORT_NS") ? std::strtoull(std::getenv("PTR_REFLECT_SHORT_NS"), nullptr, 10) : 1000) {
   #ifdef _WIN32
-                  GetCurrentProcessId()
+    const auto pid = GetCurrentProcessId();
   #else
-                  getpid()
+    const auto pid = getpid();
   #endif
-    );
+    char *name{};
+    safe_snprintf(&name, "trace_%d.json", pid);
     trace = std::fopen(name, "w");
     __RT_ALTERNATIVE(free)(name);
 
     safe_fprintf(trace, "[\n");
+    if (!std::getenv("PTR_REFLECT_NO_SHM") && !metrics.open(pid, ns(start)))
+      safe_fprintf(stderr, "[PtrReflect] unable to create shared-memory metrics segment\n");
     safe_fprintf(stderr, "[PtrReflect] started\n");
     interpose = true;
   }
 
   __RT_PROTECT bool blockingRecord(const _rt_PtrInfo &info, const time_point<steady_clock> now = steady_clock::now()) {
     std::unique_lock lock(mutex);
-    // safe_fprintf(stderr, "[PtrReflect] record %p(size=%ld, type=%s)\n", reinterpret_cast<void *>(info.ptr), info.size,
-    //              to_string(info.type));
-
-    auto inserted = data.emplace(info.ptr, PtrRecord{now, info});
-    if (!inserted) {
-      safe_fprintf(stderr, "[PtrReflect] failed to insert %p (size=%ld, type=%s)\n", reinterpret_cast<void *>(info.ptr), info.size,
-                   to_string(info.type));
-      fail();
-    }
+    recordLocked(info, now);
     return true;
   }
 
   __RT_PROTECT bool blockingRelease(uintptr_t ptr, _rt_Type type, const time_point<steady_clock> now = steady_clock::now()) {
     std::unique_lock lock(mutex);
-    // safe_fprintf(stderr, "[PtrReflect] release %p (type=%s)\n", reinterpret_cast<void *>(ptr), to_string(type));
-    static int i = 0;
-    if (auto it = queryUnsafe(ptr, false)) {
-      const auto [recordPoint, info] = *it;
-      safe_fprintf(trace,
-                   "  {"
-                   "\"name\": \"0x%lx (%ld)\","
-                   "\"cat\": \"%s\", "
-                   "\"ph\": \"X\", "
-                   "\"ts\": %" PRId64 " , "
-                   "\"dur\": %" PRId64 ", \"pid\": %d, \"tid\": %d},\n",
-                   info.ptr, info.size, to_string(info.type),                                      //
-                   duration_cast<microseconds>(recordPoint.time_since_epoch()).count(),            //
-                   duration_cast<microseconds>(now - recordPoint).count(), to_integral(info.type), //
-                   0);
-      data.erase(ptr);
-      i++;
-      if (i % 100 == 0) std::fflush(trace);
+    releaseLocked(ptr, type, now);
+    return true;
+  }
+
+  // munmap of `length` bytes (whole pages) at `ptr`. Mappings are only indexed by their start: unmapping all of the one recorded there
+  // ends it and unmapping its head moves its start past the hole, while a tail or interior unmap leaves the record as it is.
+  __RT_PROTECT bool blockingUnmap(uintptr_t ptr, size_t length, const time_point<steady_clock> now = steady_clock::now()) {
+    std::unique_lock lock(mutex);
+    PtrRecord *record = data.find(ptr);
+    if (!record || length >= record->info.size) {
+      releaseLocked(ptr, _rt_Type::MUnmap, now);
       return true;
     }
-    safe_fprintf(stderr, "[PtrReflect] failed to release %p (type=%s)\n", reinterpret_cast<void *>(ptr), to_string(type));
-    // raise(SIGTRAP);
-    // fail();
+    const _rt_PtrInfo before = record->info;
+    bool moved;
+    {
+      SeqLock::WriteGuard guard(version);
+      if ((moved = data.rekey(ptr, ptr + length))) record->info = _rt_PtrInfo{ptr + length, before.size - length, before.type};
+    }
+    if (moved) resizedLocked(before, record->info, record->id, now);
+    else releaseLocked(ptr, _rt_Type::MUnmap, now); // the rest is already recorded as something else
     return true;
   }
 
+  // realloc with the record moved along. The underlying realloc runs outside of the writer lock so other threads keep allocating
+  // meanwhile, and the record stays where it is until realloc returns, so lookups keep finding the old block; the record is then resized in
+  // place or rekeyed to the new address under a single write. Once realloc frees the old block, another thread may record that address
+  // before the resize lands; displaceLocked parks the stale record for us instead of letting it collide. The record keeps its start time,
+  // type and id; the trace gets an instant resize event instead of a free and a fresh allocation.
+  template <typename Realloc>
+  __RT_PROTECT void *blockingResize(uintptr_t ptr, size_t size, Realloc reallocFn,
+                                    const time_point<steady_clock> now = steady_clock::now()) {
+    bool tracked;
+    {
+      std::unique_lock lock(mutex);
+      tracked = data.find(ptr) && resizing.emplace(ptr, std::nullopt);
+    }
+    void *moved = reallocFn(reinterpret_cast<void *>(ptr), size);
+    const auto to = reinterpret_cast<uintptr_t>(moved);
+    std::unique_lock lock(mutex);
+    if (!tracked) { // allocated before startup or outside of the interposers
+      if (moved) recordLocked(_rt_PtrInfo{to, size, _rt_Type::HeapRealloc}, now);
+      return moved;
+    }
+    const std::optional<PtrRecord> parked = *resizing.find(ptr);
+    resizing.erase(ptr);
+    if (!moved) {
+      if (size != 0) return moved; // the block is left untouched and its address is still ours
+      if (parked) retireLocked(*parked, now); // realloc(p, 0) may free and return null
+      else releaseLocked(ptr, _rt_Type::HeapRealloc, now);
+      return moved;
+    }
+    if (to != ptr) displaceLocked(to); // the new block may be the freed old address of another resize in flight
+    PtrRecord *current = parked ? nullptr : data.find(ptr);
+    const _rt_PtrInfo before = parked ? parked->info : current ? current->info : _rt_PtrInfo{ptr, 0, _rt_Type::HeapRealloc};
+    const _rt_PtrInfo after{to, size, before.type};
+    bool updated = current || parked;
+    {
+      SeqLock::WriteGuard guard(version);
+      if (parked) updated = data.emplace(to, PtrRecord{parked->point, after, parked->tid, parked->id});
+      else if (current && to == ptr) current->info = after;
+      else if (current && (updated = data.rekey(ptr, to))) current->info = after; // rekey keeps the node, `current` still points at it
+    }
+    if (!updated) {
+      safe_fprintf(stderr, "[PtrReflect] failed to move %p to %p (size=%ld, type=%s)\n", reinterpret_cast<void *>(ptr), moved, size,
+                   to_string(before.type));
+      fail();
+    }
+    const uint64_t id = parked ? parked->id : current->id;
+    resizedLocked(before, _rt_PtrInfo{to, size, before.type}, id, now);
+    return moved;
+  }
+
   __RT_PROTECT ~ReflectService() {
     interpose = false;
     const auto now = steady_clock::now();
@@ -242,19 +543,36 @@ public:
                  0);
     safe_fprintf(trace, "]");
     std::fclose(trace);
+    metrics.close();
+    if (!std::getenv("PTR_REFLECT_NO_LIFETIMES")) lifetimes.dump(stderr);
     safe_fprintf(stderr, "[PtrReflect] terminated\n");
   }
 
-  __RT_PROTECT _rt_PtrInfo *blockingQuery(void *ptr) {
-    std::shared_lock lock(mutex);
-    if (auto it = queryUnsafe(reinterpret_cast<uintptr_t>(ptr), true)) return &it->info;
-    return {};
+  // Formatting and stdio may allocate, which would re-enter the interposers and deadlock on `mutex`, so only the copy is taken under it.
+  __RT_PROTECT void blockingDumpLifetimes(std::FILE *out) {
+    std::unique_lock lock(mutex);
+    const LifetimeStats snapshot = lifetimes;
+    lock.unlock();
+    snapshot.dump(out);
+  }
+
+  // Optimistic, lock-free lookup: readers never store to shared memory, so concurrent queries scale with the number of threads. A query
+  // that overlaps a write is detected through `version` and retried (a bounded number of times, see optimistic()); the record is copied
+  // out so it stays valid after release.
+  __RT_PROTECT bool query(uintptr_t ptr, _rt_PtrInfo &out) const {
+    return optimistic([&](auto valid) { return queryRacy(ptr, out, valid); });
   }
 
-  __RT_PROTECT size_t *blockingQuerySize(void *ptr) {
-    std::shared_lock lock(mutex);
-    if (auto it = queryUnsafe(reinterpret_cast<uintptr_t>(ptr), true)) return &it->info.size;
-    return {};
+  // Exact lookup of an object's base address, without the containment scan: O(1) for bounds checks, which always know the base. A pool
+  // block and a sub-allocation carved from its start share the base, and the access may be through either, so the larger record wins.
+  __RT_PROTECT bool queryBase(uintptr_t base, _rt_PtrInfo &out) const {
+    return optimistic([&](auto valid) {
+      _rt_PtrInfo inner{}, outer{};
+      const bool foundInner = nested.findRacy(base, [&](uintptr_t, const PtrRecord &value) { inner = value.info; }, valid);
+      const bool foundOuter = data.findRacy(base, [&](uintptr_t, const PtrRecord &value) { outer = value.info; }, valid);
+      if (foundInner || foundOuter) out = foundOuter && (!foundInner || outer.size >= inner.size) ? outer : inner;
+      return foundInner || foundOuter;
+    });
   }
 };
 
@@ -265,9 +583,42 @@ __RT_PROTECT inline ReflectService *_rt_get() {
 }
 inline auto _ = _rt_get();
 
+__RT_PROTECT __attribute__((noinline, cold)) void outOfBounds(const _rt_PtrInfo &info, uintptr_t lo, uintptr_t hi) {
+  static const bool keepGoing = std::getenv("PTR_REFLECT_BOUNDS_CONTINUE") != nullptr;
+  safe_fprintf(stderr, "[PtrReflect] out-of-bounds access [%p, %p) to %p (size=%ld, type=%s)\n", reinterpret_cast<void *>(lo),
+               reinterpret_cast<void *>(hi), reinterpret_cast<void *>(info.ptr), info.size, to_string(info.type));
+  if (!keepGoing) fail();
+}
+
+// True if `ptr` lies in the small-object arena, with `found` set if it points into a live allocation: pure address arithmetic, no table.
+__RT_PROTECT inline bool queryArena(uintptr_t ptr, _rt_PtrInfo &out, bool &found) {
+  #ifdef PTR_REFLECT_ARENA
+  if (!arena().owns(ptr)) return false;
+  uint8_t type{};
+  found = arena().query(ptr, out.ptr, out.size, type);
+  out.type = static_cast<_rt_Type>(type);
+  return true;
+  #else
+  return false;
+  #endif
+}
+
+__RT_PROTECT inline void checkBounds(uintptr_t base, uintptr_t lo, uintptr_t hi) {
+  _rt_PtrInfo info{};
+  bool found{};
+  if (queryArena(base, info, found)) {
+    if (found && (lo < info.ptr || hi > info.ptr + info.size)) outOfBounds(info, lo, hi);
+    return;
+  }
+  if (!serviceInit.load(std::memory_order_relaxed)) return;
+  if (!_rt_get()->queryBase(base, info)) return; // objects the runtime doesn't know about (globals, foreign memory) pass
+  if (lo < info.ptr || hi > info.ptr + info.size) outOfBounds(info, lo, hi);
+}
+
 } // namespace details
 
 extern "C" __RT_PROTECT __attribute__((noinline)) void _rt_record(void *ptr, size_t size, _rt_Type type) {
+  if (!ptr) return;
   if (!details::serviceInit.load()) return;
   details::_rt_get()->blockingRecord(_rt_PtrInfo{reinterpret_cast<uintptr_t>(ptr), size, type});
 }
@@ -276,9 +627,43 @@ extern "C" __RT_PROTECT __attribute__((noinline)) void _rt_release(void *ptr, _r
   if (!details::serviceInit.load()) return;
   details::_rt_get()->blockingRelease(reinterpret_cast<uintptr_t>(ptr), type);
 }
+extern "C" __RT_PROTECT __attribute__((noinline)) void _rt_unmap(void *ptr, size_t length) {
+  if (!ptr) return;
+  if (!details::serviceInit.load()) return;
+  details::_rt_get()->blockingUnmap(reinterpret_cast<uintptr_t>(ptr), length);
+}
+// Resizes `ptr` with `reallocFn` and moves its record along, see ReflectService::blockingResize.
+extern "C" __RT_PROTECT __attribute__((noinline)) void *_rt_resize(void *ptr, size_t size, void *(*reallocFn)(void *, size_t)) {
+  if (!ptr || !details::serviceInit.load()) return reallocFn(ptr, size);
+  return details::_rt_get()->blockingResize(reinterpret_cast<uintptr_t>(ptr), size, reallocFn);
+}
 
-__RT_PROTECT _rt_PtrInfo *reflect(void *ptr) { return details::_rt_get()->blockingQuery(ptr); }
-__RT_PROTECT size_t *reflectSize(void *ptr) { return details::_rt_get()->blockingQuerySize(ptr); }
+extern "C" __RT_PROTECT __attribute__((noinline)) bool _rt_query(void *ptr, _rt_PtrInfo *out) {
+  if (bool found{}; details::queryArena(reinterpret_cast<uintptr_t>(ptr), *out, found)) return found;
+  return details::_rt_get()->query(reinterpret_cast<uintptr_t>(ptr), *out);
+}
+
+// Bounds checks inserted by the plugin when PTR_REFLECT_BOUNDS is set. `used` keeps them alive until the plugin runs.
+extern "C" __RT_PROTECT __attribute__((noinline, used)) void _rt_check(void *base, void *ptr, size_t size) {
+  const auto lo = reinterpret_cast<uintptr_t>(ptr);
+  details::checkBounds(reinterpret_cast<uintptr_t>(base), lo, lo + size);
+}
+// All accesses of `size` bytes from `first` to `last` in a loop, hoisted to the preheader; either end may be the lower one.
+extern "C" __RT_PROTECT __attribute__((noinline, used)) void _rt_check_range(void *base, void *first, void *last, size_t size) {
+  const auto a = reinterpret_cast<uintptr_t>(first), b = reinterpret_cast<uintptr_t>(last);
+  details::checkBounds(reinterpret_cast<uintptr_t>(base), std::min(a, b), std::max(a, b) + size);
+}
+
+__RT_PROTECT std::optional<_rt_PtrInfo> reflect(void *ptr) {
+  _rt_PtrInfo info{};
+  if (_rt_query(ptr, &info)) return info;
+  return {};
+}
+__RT_PROTECT std::optional<size_t> reflectSize(void *ptr) {
+  if (auto info = reflect(ptr)) return info->size;
+  return {};
+}
+__RT_PROTECT void dumpLifetimes(std::FILE *out) { details::_rt_get()->blockingDumpLifetimes(out); }
 
 #endif
 }; // namespace ptr_reflect
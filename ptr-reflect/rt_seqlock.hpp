@@ -0,0 +1,61 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+
+#include "rt_protected.hpp"
+
+namespace ptr_reflect::details {
+
+// Sequence lock: writers (already serialised by an external mutex) bump the counter to odd before mutating and back to even after.
+// Readers never write shared memory; they snapshot the counter, read optimistically, and retry if the counter moved in between.
+class SeqLock {
+  std::atomic<uint64_t> _seq{0};
+
+public:
+  class WriteGuard {
+    SeqLock &lock;
+
+  public:
+    __RT_PROTECT explicit WriteGuard(SeqLock &lock) : lock(lock) { lock.writeBegin(); }
+    __RT_PROTECT ~WriteGuard() { lock.writeEnd(); }
+    __RT_PROTECT WriteGuard(const WriteGuard &) = delete;
+    __RT_PROTECT WriteGuard &operator=(const WriteGuard &) = delete;
+  };
+
+  __RT_PROTECT void writeBegin() {
+    _seq.store(_seq.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+  }
+
+  __RT_PROTECT void writeEnd() { _seq.store(_seq.load(std::memory_order_relaxed) + 1, std::memory_order_release); }
+
+  __RT_PROTECT [[nodiscard]] uint64_t readBegin() const {
+    uint64_t seq;
+    while ((seq = _seq.load(std::memory_order_acquire)) & 1)
+      pause();
+    return seq;
+  }
+
+  // readBegin() without the wait, for readers that can't trust the writer to ever finish (e.g. one in another process that may have died
+  // mid-write): false while a write is in progress.
+  __RT_PROTECT [[nodiscard]] bool tryReadBegin(uint64_t &seq) const { return !((seq = _seq.load(std::memory_order_acquire)) & 1); }
+
+  __RT_PROTECT [[nodiscard]] bool readValid(uint64_t seq) const {
+    std::atomic_thread_fence(std::memory_order_acquire);
+    return _seq.load(std::memory_order_relaxed) == seq;
+  }
+
+  __RT_PROTECT static void pause() {
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#elif defined(__aarch64__)
+    asm volatile("yield");
+#endif
+  }
+};
+
+// Racy read of a field that may be concurrently written under a SeqLock; the result is only meaningful once readValid() succeeds.
+template <typename T> __RT_PROTECT T racyLoad(const T &ref) { return __atomic_load_n(&ref, __ATOMIC_RELAXED); }
+
+} // namespace ptr_reflect::details
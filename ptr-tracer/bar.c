@@ -27,5 +27,8 @@ int main(int argc, char **argv) {
   int *xs = malloc(sizeof(int) * 10);
   foo2(xs, 5, xs);
   bar(xs, 6, &argc);
+
+  const char *home = getenv("HOME");
+  puts(home ? home : "");
   return 0;
 }
\ No newline at end of file
@@ -0,0 +1,61 @@
+// Effect of PTR_TRACER_ANNOTATE on the kernels in bench_kernels.c, see the `bench` target in the Makefile.
+// Every buffer is a fresh allocation passed straight to the kernels, so the annotation pass can prove the parameters noalias and
+// dereferenceable. Prints one `<kernel> <ms>` line per kernel (best of several runs).
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#define N (1 << 22)
+#define RUNS 7
+
+void accumulate(long *sum, const int *xs, int n);
+void scale(float *out, const float *in, const float *factor, int n);
+void histogram(int *bins, const unsigned char *data, int n);
+void stencil(float *out, const float *in, int n);
+
+static double now_ms(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+}
+
+#define TIME(name, call)                                                                                                                   \
+  do {                                                                                                                                     \
+    double best = 1e300;                                                                                                                   \
+    for (int r = 0; r < RUNS; r++) {                                                                                                       \
+      double start = now_ms();                                                                                                             \
+      call;                                                                                                                                \
+      double elapsed = now_ms() - start;                                                                                                   \
+      best = elapsed < best ? elapsed : best;                                                                                              \
+    }                                                                                                                                      \
+    printf("%s %.3f\n", name, best);                                                                                                       \
+  } while (0)
+
+int main(void) {
+  int *xs = malloc(N * sizeof(int));
+  float *in = malloc(N * sizeof(float));
+  float *out = malloc(N * sizeof(float));
+  unsigned char *data = malloc(N);
+  for (int i = 0; i < N; i++) {
+    xs[i] = i % 97;
+    in[i] = (float)(i % 13);
+    out[i] = 0;
+    data[i] = (unsigned char)(i * 2654435761u >> 24);
+  }
+
+  long sum = 0;
+  float factor = 1.5f;
+  int bins[16] = {0};
+  TIME("accumulate", accumulate(&sum, xs, N));
+  TIME("scale", scale(out, in, &factor, N));
+  TIME("histogram", histogram(bins, data, N));
+  TIME("stencil", stencil(out, in, N));
+
+  fprintf(stderr, "# checksum %ld %g %d\n", sum, out[N / 2], bins[3]);
+  free(xs);
+  free(in);
+  free(out);
+  free(data);
+  return 0;
+}
@@ -0,0 +1,22 @@
+// Loop kernels for the annotation benchmark, kept in their own translation unit so only LTO sees both sides of each call.
+// Every kernel reads or writes through a pointer the compiler has to assume may alias the others, see bench.c.
+
+__attribute__((noinline)) void accumulate(long *sum, const int *xs, int n) {
+  for (int i = 0; i < n; i++)
+    *sum += xs[i];
+}
+
+__attribute__((noinline)) void scale(float *out, const float *in, const float *factor, int n) {
+  for (int i = 0; i < n; i++)
+    out[i] = in[i] * *factor;
+}
+
+__attribute__((noinline)) void histogram(int *bins, const unsigned char *data, int n) {
+  for (int i = 0; i < n; i++)
+    bins[data[i] & 15]++;
+}
+
+__attribute__((noinline)) void stencil(float *out, const float *in, int n) {
+  for (int i = 1; i < n - 1; i++)
+    out[i] = 0.25f * in[i - 1] + 0.5f * in[i] + 0.25f * in[i + 1];
+}
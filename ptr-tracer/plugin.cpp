@@ -1,21 +1,55 @@
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/ADT/DenseSet.h"
+#include "llvm/ADT/MapVector.h"
+#include "llvm/ADT/ScopeExit.h"
+#include "llvm/ADT/SetVector.h"
+#include "llvm/ADT/SparseBitVector.h"
+#include "llvm/Analysis/CaptureTracking.h"
+#include "llvm/Analysis/ConstantFolding.h"
 #include "llvm/Analysis/LazyCallGraph.h"
+#include "llvm/Analysis/MemoryBuiltins.h"
+#include "llvm/Analysis/MemorySSA.h"
+#include "llvm/Analysis/TargetLibraryInfo.h"
+#include "llvm/Analysis/TypeMetadataUtils.h"
 #include "llvm/Analysis/ValueTracking.h"
+#include "llvm/IR/ConstantRange.h"
 #include "llvm/IR/AbstractCallSite.h"
+#include "llvm/IR/AssemblyAnnotationWriter.h"
+#include "llvm/IR/Dominators.h"
 #include "llvm/IR/Function.h"
+#include "llvm/IR/IRBuilder.h"
+#include "llvm/IR/InstIterator.h"
 #include "llvm/IR/Instructions.h"
+#include "llvm/IR/IntrinsicInst.h"
 #include "llvm/IR/LegacyPassManager.h"
 #include "llvm/IR/Module.h"
+#include "llvm/IR/ModuleSlotTracker.h"
 #include "llvm/Pass.h"
 #include "llvm/Passes/PassBuilder.h"
 #include "llvm/Passes/PassPlugin.h"
+#include "llvm/Support/CachePruning.h"
 #include "llvm/Support/FileSystem.h"
+#include "llvm/Support/Format.h"
+#include "llvm/Support/FormattedStream.h"
+#include "llvm/Support/JSON.h"
+#include "llvm/Support/MD5.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/ThreadPool.h"
 #include "llvm/Support/raw_ostream.h"
+#include "llvm/Transforms/Utils/Cloning.h"
 
+#include <atomic>
+#include <chrono>
 #include <cxxabi.h>
+#include <deque>
 #include <filesystem>
-#include <unordered_set>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <numeric>
 
 #include "../plugin_utils.h"
+#include "report_db.h"
 
 #ifdef __APPLE__
   #include <crt_externs.h>
@@ -52,92 +86,997 @@ template <typename Node, typename... Fs> void visitDyn0(Node n, Fs... fs) {
   }() || ...);
 }
 
-class tee_ostream : public raw_ostream {
-private:
-  raw_ostream &out;
-  std::unique_ptr<raw_fd_ostream> file;
+// A summary of where a set of values may originate from.
+// Every summary along a chain of N values would hold the set of values reached after it, so that set is only kept up to ReachedLimit
+// values; past that, indirections is a lower bound carried like depth (the longest path counts every value on it once).
+struct OriginSummary {
+  static constexpr size_t ReachedLimit = 4096;
 
-  uint64_t current_pos() const override { return 0; }
+  SparseBitVector<> origins;   // value numbers of the origins
+  SparseBitVector<> arguments; // value numbers of the enclosing function's arguments not yet resolved to their callers
+  SparseBitVector<> reached;   // value numbers of every node traced through, including the origins, empty once inexact
+  size_t indirections{};       // values traced through, reached.count() unless inexact
+  size_t depth{};              // longest path to an origin, an SCC counts as a single step
+  bool truncated{};            // a budget ran out before everything was traced, see QueryBudget
+  bool inexact{};              // more than ReachedLimit values were traced through, indirections is a lower bound
 
-  void write_impl(const char *Ptr, size_t Size) override {
-    out.write(Ptr, Size);
-    if (file) file->write(Ptr, Size);
+  void reach(unsigned N) {
+    OriginSummary One;
+    One.reached.set(N);
+    One.indirections = 1;
+    reachAll(One, 0);
   }
+  // Accounts for the values `that` traced through, `steps` values away (at least that many values of ours aren't among them).
+  void reachAll(const OriginSummary &that, size_t steps) {
+    if (!inexact && !that.inexact) {
+      reached |= that.reached;
+      indirections = reached.count();
+      if (indirections <= ReachedLimit) return;
+    }
+    if (!inexact) {
+      inexact = true;
+      reached.clear();
+    }
+    indirections = std::max(indirections, that.indirections + steps);
+  }
+  void merge(const OriginSummary &that, size_t steps) {
+    origins |= that.origins;
+    arguments |= that.arguments;
+    reachAll(that, steps);
+    depth = std::max(depth, that.depth + steps);
+    truncated |= that.truncated;
+  }
+  bool sameSets(const OriginSummary &that) const {
+    return origins == that.origins && arguments == that.arguments && reached == that.reached && truncated == that.truncated &&
+           inexact == that.inexact;
+  }
+};
+
+// Tracing limits for the whole module, shared by every thread. Zero means unlimited.
+struct ModuleBudget {
+  uint64_t maxNodes;
+  std::chrono::steady_clock::time_point deadline;
+  std::atomic<uint64_t> nodes{};
+
+  ModuleBudget(uint64_t maxNodes, uint64_t maxMs)
+      : maxNodes(maxNodes), deadline(maxMs ? std::chrono::steady_clock::now() + std::chrono::milliseconds(maxMs)
+                                           : std::chrono::steady_clock::time_point::max()) {}
+};
+
+// Tracing limits for a single query, on top of the module's. Running out doesn't fail the query: the nodes it would have expanded next
+// are left out and the summary is marked truncated, along with every summary that includes it.
+class QueryBudget {
+  ModuleBudget &module;
+  uint64_t maxNodes, nodes{};
+  std::chrono::steady_clock::time_point deadline;
+  bool exhausted;
 
 public:
-  tee_ostream(raw_ostream &out, const std::optional<std::string> &path) : raw_ostream(true), out(out) {
-    std::error_code EC;
-    if (path) {
-      file = std::make_unique<raw_fd_ostream>(*path, EC, sys::fs::OF_Text);
-      if (EC) {
-        errs() << "Error: Unable to open file " << *path << ": " << EC.message() << "\n";
+  QueryBudget(ModuleBudget &module, uint64_t maxNodes, uint64_t maxMs) : module(module), maxNodes(maxNodes) {
+    const auto Now = std::chrono::steady_clock::now();
+    deadline = maxMs ? Now + std::chrono::milliseconds(maxMs) : std::chrono::steady_clock::time_point::max();
+    exhausted = Now > module.deadline;
+  }
+
+  // Accounts for expanding one more node, false once out of budget. The clock is only read every 256 nodes.
+  bool take() {
+    if (exhausted) return false;
+    ++nodes;
+    if (maxNodes && nodes > maxNodes) exhausted = true;
+    else if (module.maxNodes && module.nodes.fetch_add(1, std::memory_order_relaxed) >= module.maxNodes) exhausted = true;
+    else if (nodes % 256 == 0) {
+      const auto Now = std::chrono::steady_clock::now();
+      exhausted = Now > deadline || Now > module.deadline;
+    }
+    return !exhausted;
+  }
+};
+
+// Budgets from PTR_TRACER_{QUERY,MODULE}_{NODES,MS}, all unlimited by default.
+struct TraceLimits {
+  ModuleBudget module{getEnvUnsigned("PTR_TRACER_MODULE_NODES", 0), getEnvUnsigned("PTR_TRACER_MODULE_MS", 0)};
+  uint64_t queryNodes = getEnvUnsigned("PTR_TRACER_QUERY_NODES", 0), queryMs = getEnvUnsigned("PTR_TRACER_QUERY_MS", 0);
+
+  QueryBudget query() { return QueryBudget(module, queryNodes, queryMs); }
+  bool unlimited() const {
+    return !module.maxNodes && module.deadline == std::chrono::steady_clock::time_point::max() && !queryNodes && !queryMs;
+  }
+};
+
+// Memoised Tarjan SCC search over a graph of value numbers, folding one OriginSummary per SCC so every node is expanded at most once and
+// cycles are summarised as a whole instead of being cut short wherever the search happened to enter them.
+// The search runs on an explicit stack, and node state lives in a flat array over the range of value numbers the graph is expected to
+// cover (e.g. one function), with a map for anything outside it.
+// Expand(Node, Successors) appends the node's successors and returns its own contribution to the summary.
+class SCCSummaries {
+  static constexpr uint32_t Unvisited = 0, Done = 1u << 31; // otherwise Tarjan index + 1 while on the stack
+
+  struct Frame {
+    unsigned node, low;
+    SmallVector<unsigned, 4> successors;
+    OriginSummary own;
+  };
+
+  unsigned base;
+  std::vector<uint32_t> states; // per value number in [base, base + states.size())
+  DenseMap<unsigned, uint32_t> far;
+  std::deque<OriginSummary> summaries; // indexed by SCC, a deque so references survive later queries
+
+  std::vector<Frame> frames; // indexed by Tarjan index, for the current query
+  std::vector<unsigned> stack;
+  std::vector<std::pair<unsigned, unsigned>> path; // DFS path: (Tarjan index, next successor)
+
+  uint32_t &state(unsigned Node) { return Node - base < states.size() ? states[Node - base] : far[Node]; }
+
+  template <typename Expand> void push(unsigned Node, Expand &expand) {
+    const unsigned Index = frames.size();
+    state(Node) = Index + 1;
+    stack.push_back(Index);
+    path.emplace_back(Index, 0);
+    frames.push_back({Node, Index, {}, {}});
+    auto own = expand(Node, frames[Index].successors);
+    frames[Index].own = std::move(own);
+  }
+
+  // Node heads an SCC: its members are everything above it on the stack.
+  void complete(unsigned Index) {
+    const unsigned SCC = summaries.size();
+    const auto Members = ArrayRef<unsigned>(stack).drop_front(std::lower_bound(stack.begin(), stack.end(), Index) - stack.begin());
+    for (auto M : Members)
+      state(frames[M].node) = Done | SCC;
+    OriginSummary Summary;
+    for (auto M : Members) {
+      Summary.merge(frames[M].own, 0);
+      for (auto Succ : frames[M].successors)
+        if (auto Other = state(Succ) & ~Done; Other != SCC) Summary.merge(summaries[Other], 1);
+    }
+    stack.resize(stack.size() - Members.size());
+    summaries.push_back(std::move(Summary));
+  }
+
+public:
+  SCCSummaries(unsigned base = 0, unsigned size = 0) : base(base), states(size, Unvisited) {}
+
+  // The returned summary stays valid until the next clear().
+  template <typename Expand> const OriginSummary &get(unsigned Node, Expand expand, QueryBudget &budget) {
+    if (auto S = state(Node); S & Done) return summaries[S & ~Done];
+    budget.take();
+    push(Node, expand);
+    while (!path.empty()) {
+      auto &[Index, Next] = path.back();
+      if (Next < frames[Index].successors.size()) {
+        auto &Frame = frames[Index];
+        const auto Succ = Frame.successors[Next++];
+        if (const auto S = state(Succ); S & Done) continue;
+        else if (S != Unvisited) Frame.low = std::min(Frame.low, S - 1); // still on the stack
+        else if (!budget.take()) {
+          Frame.own.truncated = true;
+          Frame.successors[Next - 1] = Frame.node; // left out, and skipped when merging like any edge within the SCC
+        } else push(Succ, expand);
+        continue;
       }
+      const unsigned Head = Index, Low = frames[Index].low;
+      path.pop_back();
+      if (!path.empty()) frames[path.back().first].low = std::min(frames[path.back().first].low, Low);
+      if (Low == Head) complete(Head);
     }
+    frames.clear(); // every node visited is in an SCC by now
+    return summaries[state(Node) & ~Done];
+  }
+
+  void clear() {
+    std::fill(states.begin(), states.end(), Unvisited);
+    far.clear();
+    summaries.clear();
   }
 };
 
-size_t traceValueOrigin(llvm::Value *V, std::vector<llvm::Value *> &Results, std::unordered_set<Value *> &Visited, size_t depth = 0) {
-  auto traceSingle0 = [&](auto V) -> size_t { return traceValueOrigin(V, Results, Visited, depth + 1); };
-  auto traceSingle = [&](auto V) -> void { depth = std::max(depth, traceValueOrigin(V, Results, Visited, depth + 1)); };
-  auto traceFn = [&](CallBase *CB) -> size_t {
-    auto F = CB->getCalledFunction();
-    if (!F) return traceSingle0(CB);
-    if (F->isDeclaration()) return traceSingle0(F);
-    for (auto &BB : *F) {
-      for (auto &Inst : BB) {
-        if (auto R = dyn_cast<llvm::ReturnInst>(&Inst)) {
-          if (auto RV = R->getReturnValue()) traceSingle(RV);
+// On-disk cache of per-function summaries across links, see OriginTracer. Entries are JSON files named after their key, written under a
+// temporary name and renamed into place so concurrent links never read a partial entry, and the directory is pruned like an LTO cache.
+class SummaryCache {
+  std::string dir;
+  size_t hits{}, misses{};
+  std::chrono::microseconds saved{};
+
+public:
+  explicit SummaryCache(std::string dir) : dir(std::move(dir)) { sys::fs::create_directories(this->dir); }
+
+  // PTR_TRACER_CACHE_DIR, else a ptr-tracer directory in the linker's LTO cache directory. Budgets make a summary depend on what was
+  // traced before it, so nothing is cached while any is set.
+  static std::optional<std::string> directory(const TraceLimits &Limits) {
+    if (!Limits.unlimited()) return {};
+    if (auto Dir = getEnv("PTR_TRACER_CACHE_DIR")) return Dir;
+    for (auto &Arg : getCmdLine()) {
+      StringRef Value(Arg);
+      if (Value.consume_front("--thinlto-cache-dir=") || Value.consume_front("-thinlto-cache-dir=") ||
+          Value.consume_front("/lldltocache:"))
+        return Value.str() + "/ptr-tracer";
+    }
+    return {};
+  }
+
+  std::optional<json::Value> load(StringRef Key) {
+    auto Buffer = MemoryBuffer::getFile(dir + "/llvmcache-" + Key);
+    if (!Buffer) return {};
+    auto Entry = json::parse((*Buffer)->getBuffer());
+    if (!Entry) {
+      consumeError(Entry.takeError());
+      return {};
+    }
+    return std::move(*Entry);
+  }
+
+  void store(StringRef Key, const json::Value &Entry) {
+    int FD;
+    SmallString<128> Temp;
+    if (sys::fs::createUniqueFile(dir + "/tmp-" + Key + "-%%%%%%", FD, Temp)) return;
+    {
+      raw_fd_ostream OS(FD, true);
+      OS << Entry;
+    }
+    if (sys::fs::rename(Temp, dir + "/llvmcache-" + Key)) sys::fs::remove(Temp);
+  }
+
+  void hit(std::chrono::microseconds time) { hits++, saved += time; }
+  void miss() { misses++; }
+
+  // Prints the hit rate and prunes the directory with PTR_TRACER_CACHE_POLICY, in the syntax of the linker's LTO cache policy.
+  void finish() {
+    if (hits + misses)
+      errs() << "[PtrTracer] summary cache: " << hits << " of " << hits + misses << " functions loaded ("
+             << format("%.1f", 100.0 * hits / (hits + misses)) << "%), saving " << saved.count() / 1000 << " ms of analysis\n";
+    auto Policy = parseCachePruningPolicy(getEnv("PTR_TRACER_CACHE_POLICY").value_or(""));
+    if (!Policy) {
+      errs() << "[PtrTracer] ignoring PTR_TRACER_CACHE_POLICY: " << toString(Policy.takeError()) << "\n";
+      return;
+    }
+    pruneCache(dir, *Policy);
+  }
+};
+
+// Interprocedural origin analysis in three layers:
+//  - local: values are traced within their function, stopping at its arguments, which are kept as placeholders. Calls to defined
+//    functions substitute the actual arguments into the callee's return summary instead of walking into its body.
+//  - returns: one local summary of all return values per function, built bottom-up over the call graph SCCs and iterated to a fixpoint
+//    within recursive SCCs.
+//  - arguments: placeholders left over by a query are resolved on demand through every call site of their function, again memoised.
+// With a SummaryCache, the return and call argument summaries of functions outside recursive SCCs are reused across links. An entry's
+// key covers the function's structure and the return summaries of its callees, so it is only reused where tracing would give the same
+// result; summaries are stored with globals and functions by name and everything else by position within its function.
+class OriginTracer {
+  // Values are numbered in module order up front so origin sets (and therefore the report) don't depend on the order of queries.
+  // Each function's arguments and instructions get a contiguous range, which its local memo covers with a flat array.
+  DenseMap<const Value *, unsigned> numbers;
+  std::vector<Value *> values;
+
+  DenseMap<const Function *, SCCSummaries> locals; // one entry per function created up front, constants are kept under nullptr
+  DenseMap<const Function *, OriginSummary> returns;
+  SCCSummaries arguments;
+
+  // Once the tracer is built, local() may run concurrently for different functions: numbers and values are then only read, anything
+  // that escaped the module-order numbering goes to the overflow, and the shared constants entry is locked.
+  bool frozen = false;
+  std::mutex overflowLock, constantsLock;
+  DenseMap<const Value *, unsigned> overflowNumbers;
+  std::deque<Value *> overflow;
+
+  Module &M;
+  DenseMap<const Function *, std::pair<unsigned, unsigned>> ranges; // [first, last) value number of each function
+
+  LazyCallGraph &lcg;
+  FunctionAnalysisManager &fam;
+  std::function<QueryBudget()> makeBudget;
+  DenseSet<const LazyCallGraph::SCC *> visited;      // call SCCs whose return summaries are final, or being built
+  const LazyCallGraph::SCC *current = nullptr;        // being summarised
+  DenseMap<const Function *, MemorySSA *> memorySSA; // see analyse()
+
+  // Indirect calls are resolved once per module: candidates by signature, and virtual tables by the type ids of their !type metadata.
+  DenseMap<FunctionType *, std::vector<Function *>> addressTaken;
+  DenseMap<Metadata *, std::vector<std::pair<GlobalVariable *, uint64_t>>> vtables;
+  DenseMap<const CallBase *, std::vector<Function *>> indirectCallees;
+
+  struct Pending {
+    std::string key;
+    std::chrono::microseconds time; // spent on the return summary
+  };
+  SummaryCache *cache;
+  std::string salt;                                                    // module-wide part of every key
+  DenseMap<const Function *, std::string> returnKeys;                  // hash of each encoded return summary
+  DenseMap<const Function *, Pending> pending;                         // analysed, stored once the call summaries are in
+  DenseMap<const Function *, std::vector<OriginSummary>> restoredCalls; // see restored()
+
+  // Names referenced by an encoded summary, one table per cache entry.
+  struct Symbols {
+    json::Array names;
+    StringMap<unsigned> index;
+
+    unsigned get(const std::string &Name) {
+      auto [It, Inserted] = index.try_emplace(Name, names.size());
+      if (Inserted) names.push_back(Name);
+      return It->second;
+    }
+  };
+
+  unsigned number(Value *V) {
+    if (frozen) {
+      if (auto It = numbers.find(V); It != numbers.end()) return It->second;
+      std::lock_guard<std::mutex> Guard(overflowLock);
+      auto [It, Inserted] = overflowNumbers.try_emplace(V, values.size() + overflow.size());
+      if (Inserted) overflow.push_back(V);
+      return It->second;
+    }
+    auto [It, Inserted] = numbers.try_emplace(V, values.size());
+    if (Inserted) values.push_back(V);
+    return It->second;
+  }
+
+  // Numbers C and the constants it is built from, depth-first in operand order. Not every operand is a constant: a blockaddress refers
+  // to its basic block.
+  void numberConstant(Constant *C) {
+    SmallVector<Constant *, 16> Worklist{C};
+    while (!Worklist.empty()) {
+      auto Next = Worklist.pop_back_val();
+      if (numbers.count(Next)) continue;
+      number(Next);
+      for (auto &Op : reverse(Next->operands()))
+        if (auto OpC = dyn_cast<Constant>(Op.get())) Worklist.push_back(OpC);
+    }
+  }
+
+  static std::string md5(StringRef Text) {
+    MD5 Hash;
+    Hash.update(Text);
+    MD5::MD5Result Result;
+    Hash.final(Result);
+    return std::string(Result.digest());
+  }
+
+  // A value number as (symbol, index): a function's arguments and instructions by their position in it, globals and functions by name
+  // with index -1, and a few constants by kind and integer width or address space.
+  std::optional<unsigned> decodeRef(StringRef Symbol, int64_t Index) {
+    auto numbered = [&](const Value *V) -> std::optional<unsigned> {
+      if (auto It = numbers.find(V); It != numbers.end()) return It->second;
+      return {};
+    };
+    auto &Ctx = M.getContext();
+    if (Symbol.consume_front("@")) {
+      auto G = M.getNamedValue(Symbol);
+      if (!G) return {};
+      if (Index < 0) return numbered(G);
+      auto F = dyn_cast<Function>(G);
+      auto It = F ? ranges.find(F) : ranges.end();
+      if (It == ranges.end() || static_cast<uint64_t>(Index) >= It->second.second - It->second.first) return {};
+      return It->second.first + Index;
+    }
+    if (Symbol.consume_front("i")) {
+      unsigned Width;
+      if (Symbol.getAsInteger(10, Width) || !Width || Width > 64) return {};
+      return numbered(ConstantInt::getSigned(IntegerType::get(Ctx, Width), Index));
+    }
+    if (Index < 0 || Index > 0xFFFFFF) return {};
+    auto Type = PointerType::get(Ctx, Index);
+    if (Symbol == "null") return numbered(ConstantPointerNull::get(Type));
+    if (Symbol == "undef") return numbered(UndefValue::get(Type));
+    if (Symbol == "poison") return numbered(PoisonValue::get(Type));
+    return {};
+  }
+
+  std::optional<std::pair<unsigned, int64_t>> encodeRef(unsigned N, Symbols &S) {
+    auto V = value(N);
+    if (auto F = functionOf(V)) {
+      auto It = ranges.find(F);
+      if (!F->hasName() || It == ranges.end() || N < It->second.first || N >= It->second.second) return {};
+      return std::pair(S.get("@" + F->getName().str()), static_cast<int64_t>(N - It->second.first));
+    }
+    std::string Symbol;
+    int64_t Index = -1;
+    if (auto G = dyn_cast<GlobalValue>(V)) {
+      if (!G->hasName()) return {};
+      Symbol = "@" + G->getName().str();
+    } else if (auto C = dyn_cast<ConstantInt>(V); C && C->getBitWidth() <= 64) {
+      Symbol = "i" + std::to_string(C->getBitWidth());
+      Index = C->getSExtValue();
+    } else if (V->getType()->isPointerTy() && (isa<ConstantPointerNull>(V) || isa<UndefValue>(V))) {
+      Symbol = isa<ConstantPointerNull>(V) ? "null" : isa<PoisonValue>(V) ? "poison" : "undef";
+      Index = V->getType()->getPointerAddressSpace();
+    } else return {};
+    if (decodeRef(Symbol, Index) != N) return {}; // e.g. not numbered up front, so possibly numbered differently next time
+    return std::pair(S.get(Symbol), Index);
+  }
+
+  std::optional<json::Value> encode(const OriginSummary &Summary, Symbols &S) {
+    json::Object Encoded{{"depth", static_cast<int64_t>(Summary.depth)},
+                         {"indirections", static_cast<int64_t>(Summary.indirections)},
+                         {"inexact", Summary.inexact}};
+    for (auto [Name, Set] : {std::pair<const char *, const SparseBitVector<> *>{"origins", &Summary.origins},
+                             {"arguments", &Summary.arguments},
+                             {"reached", &Summary.reached}}) {
+      json::Array Refs;
+      for (auto N : *Set) {
+        auto Ref = encodeRef(N, S);
+        if (!Ref) return {};
+        Refs.push_back(Ref->first);
+        Refs.push_back(Ref->second);
+      }
+      Encoded[Name] = std::move(Refs);
+    }
+    return json::Value(std::move(Encoded));
+  }
+
+  std::optional<OriginSummary> decode(const json::Value &Encoded, ArrayRef<std::string> Symbols) {
+    auto Object = Encoded.getAsObject();
+    if (!Object) return {};
+    OriginSummary Summary;
+    for (auto [Name, Set] : {std::pair<const char *, SparseBitVector<> *>{"origins", &Summary.origins},
+                             {"arguments", &Summary.arguments},
+                             {"reached", &Summary.reached}}) {
+      auto Refs = Object->getArray(Name);
+      if (!Refs || Refs->size() % 2) return {};
+      for (size_t i = 0; i < Refs->size(); i += 2) {
+        auto Symbol = (*Refs)[i].getAsInteger(), Index = (*Refs)[i + 1].getAsInteger();
+        if (!Symbol || !Index || *Symbol < 0 || static_cast<uint64_t>(*Symbol) >= Symbols.size()) return {};
+        auto N = decodeRef(Symbols[*Symbol], *Index);
+        if (!N) return {};
+        Set->set(*N);
+      }
+    }
+    auto Depth = Object->getInteger("depth"), Indirections = Object->getInteger("indirections");
+    auto Inexact = Object->getBoolean("inexact");
+    if (!Depth || !Indirections || !Inexact) return {};
+    Summary.depth = *Depth;
+    Summary.indirections = *Indirections;
+    Summary.inexact = *Inexact;
+    return Summary;
+  }
+
+  // Prints metadata by structure rather than by slot number, which depends on the rest of the module. Nodes already printed (including
+  // those of a cycle, e.g. an alias scope domain) are referred to by the order they were first seen in.
+  static void printMetadata(raw_ostream &OS, const Metadata *MD, DenseMap<const Metadata *, unsigned> &Seen) {
+    if (!MD) OS << "null";
+    else if (auto S = dyn_cast<MDString>(MD)) OS << '"' << S->getString() << '"';
+    else if (auto C = dyn_cast<ConstantAsMetadata>(MD)) C->getValue()->print(OS);
+    else if (auto N = dyn_cast<MDNode>(MD)) {
+      auto [It, Inserted] = Seen.try_emplace(N, Seen.size());
+      if (!Inserted) {
+        OS << '^' << It->second;
+        return;
+      }
+      OS << (N->isDistinct() ? "distinct{" : "{");
+      for (auto &Op : N->operands()) {
+        printMetadata(OS, Op.get(), Seen);
+        OS << ',';
+      }
+      OS << '}';
+    } else OS << '?';
+  }
+
+  // Hashes everything a local trace in F can depend on, see expandLocal and getUnderlyingObject: the opcode, type and operands of each
+  // instruction with locals by position, globals by name and other constants by their text, which arguments calls return, and the
+  // return summaries of the defined functions it calls or may call. Nothing if any of that can't be named. F's own name is included as
+  // entries refer to its values through it, so functions with the same body don't share one.
+  // Loads depend on more (see storedValues): the initializers of the constant globals F refers to, and whatever MemorySSA's alias
+  // queries read, i.e. the attributes of F, of its calls and of their callees, and instruction metadata other than debug locations.
+  std::optional<std::string> key(Function &F) {
+    const auto First = ranges[&F].first;
+    std::string Text = salt;
+    raw_string_ostream OS(Text);
+    OS << '@' << F.getName() << ' ';
+    F.getAttributes().print(OS);
+    for (auto &A : F.args()) {
+      A.getType()->print(OS);
+      OS << ' ';
+    }
+    SetVector<const GlobalVariable *> Constants; // read-only globals F refers to, directly or through constant expressions
+    auto collect = [&](Constant *C) {
+      SmallVector<Constant *, 8> Worklist{C};
+      SmallPtrSet<Constant *, 8> Seen;
+      while (!Worklist.empty()) {
+        auto Next = Worklist.pop_back_val();
+        if (!Seen.insert(Next).second) continue;
+        if (auto G = dyn_cast<GlobalVariable>(Next)) {
+          if (G->isConstant() && G->hasDefinitiveInitializer()) Constants.insert(G);
+        } else if (!isa<GlobalValue>(Next))
+          for (auto &Op : Next->operands())
+            if (auto OpC = dyn_cast<Constant>(Op.get())) Worklist.push_back(OpC);
+      }
+    };
+    SmallVector<StringRef, 32> KindNames; // custom kind ids depend on the order they were registered in
+    M.getContext().getMDKindNames(KindNames);
+    DenseMap<const Metadata *, unsigned> SeenMetadata;
+    SmallVector<std::pair<unsigned, MDNode *>, 4> Attached;
+    for (auto &I : instructions(F)) {
+      OS << '\n' << I.getOpcodeName() << ' ';
+      I.getType()->print(OS);
+      for (auto &Op : I.operands()) {
+        auto V = Op.get();
+        if (auto C = dyn_cast<Constant>(V)) collect(C);
+        if (isa<Instruction>(V) || isa<Argument>(V)) OS << " %" << numbers.lookup(V) - First;
+        else if (auto G = dyn_cast<GlobalValue>(V)) {
+          if (!G->hasName()) return {};
+          OS << " @" << G->getName();
+          auto CB = dyn_cast<CallBase>(&I);
+          if (auto Callee = dyn_cast<Function>(G); Callee && CB && CB->isCallee(&Op)) {
+            Callee->getAttributes().print(OS);
+            if (Callee->isDeclaration()) OS << " declared";
+            else if (auto It = returnKeys.find(Callee); It != returnKeys.end()) OS << " returning " << It->second;
+            else return {};
+          }
+        } else if (isa<Constant>(V) || isa<InlineAsm>(V)) {
+          OS << ' ';
+          V->print(OS);
+        } else OS << " _"; // blocks and metadata
+      }
+      Attached.clear();
+      SeenMetadata.clear();
+      I.getAllMetadataOtherThanDebugLoc(Attached);
+      for (auto [Kind, MD] : Attached) {
+        OS << " !" << KindNames[Kind] << ' ';
+        printMetadata(OS, MD, SeenMetadata);
+      }
+      if (auto CB = dyn_cast<CallBase>(&I)) {
+        OS << ' ';
+        CB->getAttributes().print(OS);
+        for (unsigned i = 0; i < CB->arg_size(); ++i)
+          if (CB->paramHasAttr(i, Attribute::Returned)) OS << " returned " << i;
+        for (auto Callee : indirectCallees.lookup(CB)) { // depends on the rest of the module, see resolveCallees
+          if (!Callee->hasName()) return {};
+          OS << " may call @" << Callee->getName();
+          if (Callee->isDeclaration()) OS << " declared";
+          else if (auto It = returnKeys.find(Callee); It != returnKeys.end()) OS << " returning " << It->second;
+          else return {};
         }
       }
     }
-    return depth;
-  };
+    for (auto G : Constants) {
+      if (!G->hasName()) return {};
+      OS << "\n@" << G->getName() << " = ";
+      G->getInitializer()->print(OS);
+    }
+    return md5(OS.str());
+  }
 
-  auto Root = getUnderlyingObject(V, 0);
-
-  if (auto [_, inserted] = Visited.emplace(Root); !inserted) {
-    // Results.emplace_back(Root);
-    return depth; // give up, recursive chain?
-  }
-
-  // if (depth > 100) {
-  //   Results.emplace_back(Root);
-  //   return depth; // give up, recursive chain?
-  // }
-
-  // Results.emplace_back(Root);
-
-  auto handled = visitDyn<size_t>(
-      Root,                                      //
-      [&](CallInst *C) { return traceFn(C); },   // Trace all returns
-      [&](InvokeInst *I) { return traceFn(I); }, // Trace all returns
-      [&](Argument *A) {
-        auto F = A->getParent();
-        for (auto &U : F->uses())
-          if (auto ACS = AbstractCallSite(&U)) traceSingle(ACS.getCallArgOperand(A->getArgNo()));
-        return depth;
-      },
-      [&](LoadInst *L) { return traceSingle0(L->getPointerOperand()); },
-      [&](GetElementPtrInst *GEP) { return traceSingle0(GEP->getPointerOperand()); }, // +Offset
-      [&](ExtractValueInst *EV) { return traceSingle0(EV->getAggregateOperand()); },  // FIXME may be incorrect
-      [&](InsertValueInst *IV) { return traceSingle0(IV->getAggregateOperand()); },   // FIXME may be incorrect
-      [&](IntToPtrInst *PTI) { return traceSingle0(PTI->getOperand(0)); },
-      [&](PHINode *PHI) { // Union of offsets
-        for (auto &U : PHI->incoming_values())
-          traceSingle(U.get());
-        return depth;
-      },
-      [&](SelectInst *S) { // Union of offsets
-        traceSingle(S->getTrueValue());
-        traceSingle(S->getFalseValue());
-        return depth;
-      });
-  if (handled) return *handled;
-  else {
-    Results.emplace_back(Root);
-    return depth;
+  void hashReturns(const Function &F) {
+    Symbols S;
+    if (auto Encoded = encode(returns[&F], S)) {
+      std::string Text;
+      raw_string_ostream OS(Text);
+      OS << json::Value(json::Array{std::move(S.names), std::move(*Encoded)});
+      returnKeys[&F] = md5(OS.str());
+    }
   }
-}
+
+  bool restore(const Function &F, const std::string &Key) {
+    auto Entry = cache->load(Key);
+    auto Object = Entry ? Entry->getAsObject() : nullptr;
+    if (!Object) return false;
+    auto Names = Object->getArray("symbols");
+    auto Returns = Object->get("returns");
+    auto Calls = Object->getArray("calls");
+    auto Time = Object->getInteger("us");
+    if (!Names || !Returns || !Calls || !Time) return false;
+    std::vector<std::string> Symbols;
+    for (auto &Name : *Names) {
+      auto String = Name.getAsString();
+      if (!String) return false;
+      Symbols.push_back(String->str());
+    }
+    auto Summary = decode(*Returns, Symbols);
+    if (!Summary) return false;
+    std::vector<OriginSummary> Restored;
+    for (auto &Call : *Calls) {
+      auto CallSummary = decode(Call, Symbols);
+      if (!CallSummary) return false;
+      Restored.push_back(std::move(*CallSummary));
+    }
+    returns[&F] = std::move(*Summary);
+    restoredCalls[&F] = std::move(Restored);
+    cache->hit(std::chrono::microseconds(*Time));
+    return true;
+  }
+
+  static const Function *functionOf(const Value *V) {
+    if (auto I = dyn_cast<Instruction>(V)) return I->getFunction();
+    if (auto A = dyn_cast<Argument>(V)) return A->getParent();
+    return nullptr;
+  }
+
+  // Collects the values a load may read: the initializer of a constant global at a known offset, or those of the stores it must read
+  // from, found by MemorySSA's walker through any MemoryPhis on the way. False if some clobber isn't such a store (a call, a may-alias or
+  // partial store, or memory from before the function), in which case the loaded address is all that is known.
+  bool storedValues(LoadInst *L, SmallVectorImpl<Value *> &Values) {
+    auto &DL = M.getDataLayout();
+    if (auto C = dyn_cast<Constant>(L->getPointerOperand()))
+      if (auto Folded = ConstantFoldLoadFromConstPtr(C, L->getType(), DL)) return Values.push_back(Folded), true;
+    auto It = memorySSA.find(L->getFunction());
+    if (It == memorySSA.end() || !L->isSimple()) return false;
+    auto &MSSA = *It->second;
+    auto Walker = MSSA.getWalker();
+    const auto Loc = MemoryLocation::get(L);
+    auto base = [&](Value *Ptr, int64_t &Offset) { return GetPointerBaseWithConstantOffset(Ptr, Offset, DL); };
+    int64_t LoadOffset = 0;
+    const auto LoadBase = base(L->getPointerOperand(), LoadOffset);
+
+    bool Complete = true;
+    SmallVector<MemoryAccess *, 8> Worklist{Walker->getClobberingMemoryAccess(L)};
+    SmallPtrSet<MemoryAccess *, 8> Seen;
+    while (!Worklist.empty()) {
+      auto A = Worklist.pop_back_val();
+      if (!Seen.insert(A).second) continue;
+      if (auto Phi = dyn_cast<MemoryPhi>(A)) {
+        for (unsigned i = 0; i < Phi->getNumIncomingValues(); ++i)
+          Worklist.push_back(Walker->getClobberingMemoryAccess(Phi->getIncomingValue(i), Loc));
+        continue;
+      }
+      auto Def = dyn_cast<MemoryUseOrDef>(A);
+      auto S = Def && !MSSA.isLiveOnEntryDef(Def) ? dyn_cast<StoreInst>(Def->getMemoryInst()) : nullptr;
+      int64_t StoreOffset = 0;
+      if (S && S->isSimple() && S->getValueOperand()->getType() == L->getType() && base(S->getPointerOperand(), StoreOffset) == LoadBase &&
+          StoreOffset == LoadOffset)
+        Values.push_back(S->getValueOperand());
+      else Complete = false;
+    }
+    return Complete;
+  }
+
+  // The function at Offset in every virtual table compatible with TypeId, as checked by llvm.type.test or llvm.type.checked.load.
+  std::vector<Function *> virtualSlots(int64_t Offset, Metadata *TypeId) {
+    std::vector<Function *> Slots;
+    auto It = vtables.find(TypeId);
+    if (It == vtables.end()) return Slots;
+    for (auto [G, Base] : It->second)
+      if (auto C = getPointerAtOffset(G->getInitializer(), Base + Offset, M))
+        if (auto F = dyn_cast<Function>(C->stripPointerCasts())) Slots.push_back(F);
+    return Slots;
+  }
+
+  // The type id a virtual table pointer is tested against, if any.
+  static Metadata *checkedType(Value *VTable) {
+    for (auto U : VTable->users())
+      if (auto II = dyn_cast<IntrinsicInst>(U); II && II->getArgOperand(0) == VTable) {
+        const auto ID = II->getIntrinsicID();
+#if LLVM_VERSION_MAJOR >= 15
+        if (ID == Intrinsic::public_type_test) return cast<MetadataAsValue>(II->getArgOperand(1))->getMetadata();
+#endif
+        if (ID == Intrinsic::type_test) return cast<MetadataAsValue>(II->getArgOperand(1))->getMetadata();
+      }
+    return nullptr;
+  }
+
+  // The functions an indirect call may reach. Its callee is followed through aliases, selects, PHIs, constant tables and stored function
+  // pointers (see storedValues); a pointer loaded from a virtual table whose type is checked gives the slots of every compatible table.
+  // Anything else falls back to every address-taken function of the call's type.
+  std::vector<Function *> resolveCallees(CallBase &CB) {
+    auto &DL = M.getDataLayout();
+    SmallSetVector<Function *, 4> Found;
+    SmallVector<Value *, 8> Worklist{CB.getCalledOperand()}, Values;
+    SmallPtrSet<Value *, 8> Seen;
+    bool Complete = true;
+    while (Complete && !Worklist.empty()) {
+      auto V = Worklist.pop_back_val()->stripPointerCasts();
+      if (!Seen.insert(V).second) continue;
+      if (auto F = dyn_cast<Function>(V)) Found.insert(F);
+      else if (auto GA = dyn_cast<GlobalAlias>(V)) Worklist.push_back(GA->getAliasee());
+      else if (auto S = dyn_cast<SelectInst>(V)) Worklist.append({S->getTrueValue(), S->getFalseValue()});
+      else if (auto PHI = dyn_cast<PHINode>(V)) Worklist.append(PHI->value_op_begin(), PHI->value_op_end());
+      else if (isa<ConstantPointerNull>(V) || isa<UndefValue>(V)) continue; // never called
+      else if (auto EV = dyn_cast<ExtractValueInst>(V)) {
+        auto II = dyn_cast<IntrinsicInst>(EV->getAggregateOperand());
+        auto Offset = II && II->getIntrinsicID() == Intrinsic::type_checked_load ? dyn_cast<ConstantInt>(II->getArgOperand(1)) : nullptr;
+        int64_t Base = 0;
+        auto VTable = Offset ? GetPointerBaseWithConstantOffset(II->getArgOperand(0), Base, DL) : nullptr;
+        auto Slots = VTable ? virtualSlots(Base + Offset->getSExtValue(), cast<MetadataAsValue>(II->getArgOperand(2))->getMetadata())
+                            : std::vector<Function *>{};
+        Found.insert(Slots.begin(), Slots.end());
+        Complete = EV->getIndices() == ArrayRef<unsigned>{0} && !Slots.empty();
+      } else if (auto L = dyn_cast<LoadInst>(V)) {
+        int64_t Offset = 0;
+        auto VTable = GetPointerBaseWithConstantOffset(L->getPointerOperand(), Offset, DL);
+        if (auto TypeId = checkedType(VTable)) {
+          auto Slots = virtualSlots(Offset, TypeId);
+          Found.insert(Slots.begin(), Slots.end());
+          Complete = !Slots.empty();
+        } else if (auto G = dyn_cast<GlobalVariable>(getUnderlyingObject(L->getPointerOperand()));
+                   G && G->isConstant() && G->hasDefinitiveInitializer() && !isa<Constant>(L->getPointerOperand())) {
+          // A variable index into a table of functions: any of them
+          SmallVector<Constant *, 16> Elements{G->getInitializer()};
+          while (!Elements.empty()) {
+            auto C = Elements.pop_back_val()->stripPointerCasts();
+            if (auto F = dyn_cast<Function>(C)) Found.insert(F);
+            else if (isa<ConstantAggregate>(C))
+              for (auto &Op : C->operands())
+                Elements.push_back(cast<Constant>(Op.get()));
+          }
+        } else {
+          Values.clear();
+          Complete = storedValues(L, Values);
+          Worklist.append(Values.begin(), Values.end());
+        }
+      } else Complete = false;
+    }
+    if (Complete) return {Found.begin(), Found.end()};
+    auto It = addressTaken.find(CB.getFunctionType());
+    return It == addressTaken.end() ? std::vector<Function *>{} : It->second;
+  }
+
+  // Fetches F's MemorySSA and resolves its indirect calls, before F is summarised or traced.
+  void analyse(Function &F) {
+    memorySSA[&F] = &fam.getResult<MemorySSAAnalysis>(F).getMSSA();
+    for (auto &I : instructions(F))
+      if (auto CB = dyn_cast<CallBase>(&I); CB && !CB->getCalledFunction() && !CB->isInlineAsm()) indirectCallees[CB] = resolveCallees(*CB);
+  }
+
+  // Collects the values Root may be derived from within its function and returns its own contribution to the summary.
+  OriginSummary expandLocal(Value *Root, SmallVectorImpl<unsigned> &Out) {
+    OriginSummary Own;
+    Own.reach(number(Root));
+    auto push = [&](Value *V) { Out.push_back(number(getUnderlyingObject(V, 0))); };
+    auto traceCallee = [&](CallBase *CB, Function *F, bool Indirect) {
+      if (F->isDeclaration()) return push(F);
+      auto It = returns.find(F);
+      if (It == returns.end()) {
+        // Not summarised yet: either the fixpoint of this SCC will get to it, or it is reached back through an indirect call, and all
+        // that's known is that the value comes from it. A target resolved through a table may have no call graph node yet.
+        auto *N = lcg.lookup(*F);
+        if (Indirect && (!N || lcg.lookupSCC(*N) != current)) push(F);
+        return;
+      }
+      // Substitute this call's actual arguments for the callee's parameters, see summariseReturns.
+      const auto &Callee = It->second;
+      Own.origins |= Callee.origins;
+      Own.reachAll(Callee, 1);
+      Own.depth = std::max(Own.depth, Callee.depth + 1);
+      Own.truncated |= Callee.truncated;
+      for (auto A : Callee.arguments)
+        if (auto No = cast<Argument>(value(A))->getArgNo(); No < CB->arg_size()) push(CB->getArgOperand(No));
+    };
+    auto traceFn = [&](CallBase *CB) {
+      if (auto F = CB->getCalledFunction()) traceCallee(CB, F, false);
+      else if (auto It = indirectCallees.find(CB); It != indirectCallees.end())
+        for (auto F : It->second)
+          traceCallee(CB, F, true);
+      return true;
+    };
+    auto handled = visitDyn<bool>(
+        Root,                                      //
+        [&](CallInst *C) { return traceFn(C); },   // Trace all returns
+        [&](InvokeInst *I) { return traceFn(I); }, // Trace all returns
+        [&](Argument *A) { return Own.arguments.set(number(A)), true; },
+        [&](LoadInst *L) {
+          SmallVector<Value *, 4> Values;
+          if (!storedValues(L, Values)) push(L->getPointerOperand());
+          for (auto V : Values)
+            push(V);
+          return true;
+        },
+        [&](GetElementPtrInst *GEP) { return push(GEP->getPointerOperand()), true; }, // +Offset
+        [&](ExtractValueInst *EV) { return push(EV->getAggregateOperand()), true; },  // FIXME may be incorrect
+        [&](InsertValueInst *IV) { return push(IV->getAggregateOperand()), true; },   // FIXME may be incorrect
+        [&](IntToPtrInst *PTI) { return push(PTI->getOperand(0)), true; },
+        [&](PHINode *PHI) { // Union of offsets
+          for (auto &U : PHI->incoming_values())
+            push(U.get());
+          return true;
+        },
+        [&](SelectInst *S) { // Union of offsets
+          push(S->getTrueValue());
+          push(S->getFalseValue());
+          return true;
+        });
+    if (!handled) Own.origins.set(number(Root));
+    return Own;
+  }
+
+  // Resolves an argument through the actual arguments at every call site of its function, the unresolved arguments of those become
+  // the successors.
+  OriginSummary expandArgument(Argument *A, SmallVectorImpl<unsigned> &Out, QueryBudget &Budget) {
+    OriginSummary Own;
+    Own.reach(number(A));
+    for (auto &U : A->getParent()->uses()) {
+      if (auto ACS = AbstractCallSite(&U)) {
+        auto Actual = ACS.getCallArgOperand(A->getArgNo());
+        if (!Actual) continue;
+        prepare(*ACS.getInstruction()->getFunction());
+        const auto &Caller = local(Actual, Budget);
+        Own.origins |= Caller.origins;
+        Own.reachAll(Caller, 1);
+        Own.depth = std::max(Own.depth, Caller.depth + 1);
+        Own.truncated |= Caller.truncated;
+        for (auto CallerArg : Caller.arguments)
+          Out.push_back(CallerArg);
+      }
+    }
+    return Own;
+  }
+
+  OriginSummary summariseReturns(Function &F, QueryBudget &Budget) {
+    OriginSummary Summary;
+    for (auto &BB : F)
+      if (auto R = dyn_cast<ReturnInst>(BB.getTerminator()))
+        if (auto RV = R->getReturnValue()) Summary.merge(local(RV, Budget), 0);
+    return Summary;
+  }
+
+  // Callees come before their callers, so a call's return summary is final by the time the caller is summarised. Functions calling
+  // each other are iterated until their summaries stop growing: the sets only ever grow and are bounded by the module.
+  void summarise(LazyCallGraph::SCC &C) {
+    current = &C;
+    auto Done = make_scope_exit([&]() { current = nullptr; });
+    const bool Recursive = C.size() > 1 || [&]() {
+      auto &N = *C.begin();
+      auto E = N->lookup(N);
+      return E && E->isCall();
+    }();
+    auto &Head = (*C.begin()).getFunction();
+    std::optional<std::string> Key;
+    if (cache && !Recursive) {
+      if ((Key = key(Head)) && restore(Head, *Key)) {
+        hashReturns(Head);
+        return;
+      }
+      cache->miss();
+    }
+    const auto Start = std::chrono::steady_clock::now();
+    for (bool Changed = true; Changed;) {
+      Changed = false;
+      for (auto &N : C)
+        locals[&N.getFunction()].clear(); // local summaries seen so far used the previous approximation
+      for (auto &N : C) {
+        QueryBudget Budget = makeBudget();
+        auto Summary = summariseReturns(N.getFunction(), Budget);
+        auto &Current = returns[&N.getFunction()];
+        Changed |= Recursive && !Summary.sameSets(Current);
+        Current = std::move(Summary);
+      }
+    }
+    if (Key) pending[&Head] = {*Key, std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - Start)};
+    if (cache)
+      for (auto &N : C)
+        hashReturns(N.getFunction());
+  }
+
+public:
+  // Return summaries are built under one query budget per function, for the whole module up front unless Lazy, in which case prepare()
+  // builds them for what a function calls just before it is first traced.
+  OriginTracer(Module &M, LazyCallGraph &LCG, FunctionAnalysisManager &FAM, std::function<QueryBudget()> makeBudget,
+               SummaryCache *cache = nullptr, bool Lazy = false)
+      : M(M), lcg(LCG), fam(FAM), makeBudget(std::move(makeBudget)), cache(cache) {
+    for (auto &G : M.global_values())
+      number(&G);
+    for (auto &F : M) {
+      const unsigned Begin = values.size();
+      for (auto &A : F.args())
+        number(&A);
+      for (auto &I : instructions(F))
+        number(&I);
+      locals.try_emplace(&F, Begin, values.size() - Begin);
+      ranges[&F] = {Begin, values.size()};
+    }
+    for (auto &A : M.aliases())
+      numberConstant(A.getAliasee());
+    for (auto &F : M)
+      for (auto &I : instructions(F))
+        for (auto &Op : I.operands())
+          if (auto C = dyn_cast<Constant>(Op.get())) numberConstant(C);
+    locals.try_emplace(nullptr, 0, values.size());
+    arguments = SCCSummaries(0, values.size());
+    if (cache) {
+      raw_string_ostream OS(salt);
+      OS << "ptr-tracer summaries v5\n";
+      for (auto &A : M.aliases()) {
+        OS << A.getName() << ' ' << A.getLinkage() << ' ';
+        A.getAliasee()->print(OS);
+        OS << '\n';
+      }
+    }
+
+    for (auto &F : M)
+      if (F.hasAddressTaken()) addressTaken[F.getFunctionType()].push_back(&F);
+    SmallVector<MDNode *, 2> Types;
+    for (auto &G : M.globals()) {
+      Types.clear();
+      G.getMetadata(LLVMContext::MD_type, Types);
+      for (auto T : Types)
+        if (auto Offset = mdconst::dyn_extract<ConstantInt>(T->getOperand(0)); Offset && G.hasDefinitiveInitializer())
+          vtables[T->getOperand(1).get()].emplace_back(&G, Offset->getZExtValue());
+    }
+
+    LCG.buildRefSCCs();
+    if (!Lazy)
+      for (auto &F : M)
+        prepare(F);
+    frozen = true;
+  }
+
+  // Builds the return summaries of F, of everything it may call (directly, or indirectly through the candidates of analyse()) and of the
+  // functions calling each other with it, callees first. Values of F may only be traced once this has run, which the constructor does for
+  // every function unless the tracer is lazy. Not thread-safe.
+  void prepare(const Function &F) {
+    auto N = lcg.lookup(F);
+    if (!N) return; // a declaration
+    std::vector<std::pair<LazyCallGraph::SCC *, bool>> Stack{{lcg.lookupSCC(*N), false}}; // with whether its callees were pushed
+    auto visit = [&](LazyCallGraph::SCC *C) {
+      if (!visited.count(C)) Stack.emplace_back(C, false);
+    };
+    while (!Stack.empty()) {
+      auto [C, Expanded] = Stack.back();
+      if (Expanded) {
+        Stack.pop_back();
+        summarise(*C);
+        continue;
+      }
+      if (!visited.insert(C).second) { // done, or a cycle through an indirect call
+        Stack.pop_back();
+        continue;
+      }
+      Stack.back().second = true;
+      for (auto &Caller : *C) {
+        analyse(Caller.getFunction());
+        for (auto &E : Caller->calls())
+          if (auto Callee = lcg.lookupSCC(E.getNode()); Callee != C) visit(Callee);
+      }
+      for (auto &Caller : *C)
+        for (auto &I : instructions(Caller.getFunction()))
+          if (auto It = indirectCallees.find(dyn_cast<CallBase>(&I)); It != indirectCallees.end())
+            for (auto Callee : It->second)
+              if (auto CalleeNode = lcg.lookup(*Callee); CalleeNode && lcg.lookupSCC(*CalleeNode) != C) visit(lcg.lookupSCC(*CalleeNode));
+    }
+  }
+
+  // Traces V within its function; safe to call concurrently for values of different functions. The summary stays valid for the lifetime
+  // of the tracer.
+  const OriginSummary &local(Value *V, QueryBudget &Budget) {
+    auto Root = getUnderlyingObject(V, 0);
+    auto F = functionOf(Root);
+    std::unique_lock<std::mutex> Guard(constantsLock, std::defer_lock);
+    if (!F) Guard.lock();
+    // locals has an entry for every function and expandLocal never leaves the function, so the map isn't modified during the search.
+    return locals.find(F)->second.get(
+        number(Root), [&](unsigned Node, auto &Out) { return expandLocal(value(Node), Out); }, Budget);
+  }
+
+  // Resolves the arguments a local summary still depends on through their callers. Not thread-safe: the argument memo is shared.
+  OriginSummary resolve(const OriginSummary &Local, QueryBudget &Budget) {
+    OriginSummary Summary = Local;
+    Summary.arguments.clear();
+    for (auto A : Local.arguments) {
+      auto &Resolved = arguments.get(
+          A, [&](unsigned Node, auto &Out) { return expandArgument(cast<Argument>(value(Node)), Out, Budget); }, Budget);
+      Summary.merge(Resolved, Local.depth);
+    }
+    return Summary;
+  }
+
+  // Local summaries of every pointer argument of every call in F, in order, if F's summaries were loaded from the cache.
+  const std::vector<OriginSummary> *restored(const Function &F) const {
+    auto It = restoredCalls.find(&F);
+    return It == restoredCalls.end() ? nullptr : &It->second;
+  }
+
+  // Caches F's summaries if it was analysed under a key; Calls are as for restored(), and Time is how long tracing them took.
+  void store(const Function &F, ArrayRef<const OriginSummary *> Calls, std::chrono::microseconds Time) {
+    auto It = pending.find(&F);
+    if (It == pending.end()) return;
+    Symbols S;
+    json::Array Encoded;
+    for (auto Call : Calls) {
+      auto Summary = encode(*Call, S);
+      if (!Summary) return;
+      Encoded.push_back(std::move(*Summary));
+    }
+    auto Returns = encode(returns[&F], S);
+    if (!Returns) return;
+    cache->store(It->second.key, json::Object{{"us", static_cast<int64_t>((It->second.time + Time).count())},
+                                              {"symbols", std::move(S.names)},
+                                              {"returns", std::move(*Returns)},
+                                              {"calls", std::move(Encoded)}});
+  }
+
+  Value *value(unsigned Number) {
+    if (Number < values.size()) return values[Number];
+    std::lock_guard<std::mutex> Guard(overflowLock);
+    return overflow[Number - values.size()];
+  }
+};
 
 const static std::unordered_map<std::string, std::string> AllocFunctions{
     {"aligned_alloc", "aligned_alloc"},
@@ -177,134 +1116,1012 @@ const static std::unordered_map<std::string, std::string> AllocFunctions{
     {"__libc_memalign", "aligned_alloc"},
     {"__libc_realloc", "realloc"}};
 
-static std::optional<std::string> demangleCXXName(const char *abiName) {
-  int failed;
-  char *ret = abi::__cxa_demangle(abiName, nullptr /* output buffer */, nullptr /* length */, &failed);
-  if (failed) {
-    // 0: The demangling operation succeeded.
-    // -1: A memory allocation failure occurred.
-    // -2: mangled_name is not a valid name under the C++ ABI mangling rules.
-    // -3: One of the arguments is invalid.
+enum class Kind { Stack, Heap, StdCall, LandingPad, Global, Constant, Null };
+
+// Whether a mangled name is in namespace std, without demangling: a nested name (`N`, then any cv or ref qualifiers) or an unscoped one,
+// starting with `St` or one of the std substitutions (allocator, basic_string, string and the stream typedefs).
+bool isStdMangled(StringRef Name) {
+  if (!Name.consume_front("_Z")) return false;
+  if (Name.consume_front("N")) Name = Name.ltrim("rVKRO");
+  const StringRef Std[] = {"St", "Sa", "Sb", "Ss", "Si", "So", "Sd"};
+  return is_contained(Std, Name.take_front(2));
+}
+
+// The allocator kind of every function in a module, classified once up front and read-only afterwards, so it can be queried from any
+// thread. In order of precedence:
+//  - PTR_TRACER_ALLOCATORS, a file of `<symbol> [kind]` lines (`#` starts a comment) for custom allocators; kinds are those of
+//    AllocFunctions, or `custom` by default, which counts as an allocation origin but isn't assumed to behave like any libc function
+//  - the AllocFunctions table, for names TargetLibraryInfo either doesn't know or recognises with the expected prototype
+//  - `allockind` attributes, as `allocator` or `deallocator`
+//  - `std`, for anything in namespace std
+class Allocators {
+  DenseMap<const Function *, StringRef> kinds; // only functions with a kind
+  StringMap<std::string> custom;
+
+  static StringMap<std::string> readConfig() {
+    StringMap<std::string> Config;
+    auto Path = getEnv("PTR_TRACER_ALLOCATORS");
+    if (!Path) return Config;
+    auto Buffer = MemoryBuffer::getFile(*Path);
+    if (!Buffer) {
+      errs() << "[PtrTracer] cannot read PTR_TRACER_ALLOCATORS file " << *Path << ": " << Buffer.getError().message() << "\n";
+      return Config;
+    }
+    SmallVector<StringRef, 0> Lines;
+    (*Buffer)->getBuffer().split(Lines, '\n');
+    for (auto Line : Lines) {
+      auto [Symbol, Kind] = Line.split('#').first.trim().split(' ');
+      if (Symbol.empty()) continue;
+      Kind = Kind.trim();
+      Config[Symbol] = Kind.empty() ? "custom" : Kind.str();
+    }
+    return Config;
+  }
+
+  StringRef classify(const Function &F, const TargetLibraryInfo &TLI) {
+    const auto Name = F.getName();
+    if (auto It = custom.find(Name); It != custom.end()) return It->second;
+    if (auto It = AllocFunctions.find(Name.str()); It != AllocFunctions.end()) {
+      LibFunc Func;
+      if (!TLI.getLibFunc(Name, Func) || TLI.getLibFunc(F, Func)) return It->second;
+    }
+#if LLVM_VERSION_MAJOR >= 15
+    if (auto Kind = F.getFnAttribute(Attribute::AllocKind); Kind.isValid()) {
+      const auto Flags = Kind.getAllocKind();
+      if ((Flags & (AllocFnKind::Alloc | AllocFnKind::Realloc)) != AllocFnKind::Unknown) return "allocator";
+      if ((Flags & AllocFnKind::Free) != AllocFnKind::Unknown) return "deallocator";
+    }
+#endif
+    if (isStdMangled(Name)) return "std";
     return {};
-  } else {
-    return ret;
   }
+
+public:
+  explicit Allocators(Module &M) : custom(readConfig()) {
+    TargetLibraryInfoImpl TLII{Triple(M.getTargetTriple())};
+    TargetLibraryInfo TLI(TLII);
+    for (auto &F : M)
+      if (auto Kind = classify(F, TLI); !Kind.empty()) kinds[&F] = Kind;
+  }
+
+  // The kind of F (see AllocFunctions), or an empty string.
+  StringRef kind(const Function *F) const {
+    auto It = F ? kinds.find(F) : kinds.end();
+    return It == kinds.end() ? StringRef() : It->second;
+  }
+
+  // Whether a kind is that of a function returning allocated memory, as opposed to one freeing it.
+  static bool isAllocatorKind(StringRef Kind) {
+    return !Kind.empty() && Kind != "free" && Kind != "deallocator" && Kind.find("operator_delete") != 0;
+  }
+
+  // Whether a call of that kind may free memory passed to it: deallocators and reallocators (an allockind `allocator` may be either).
+  static bool isFreeingKind(StringRef Kind) {
+    return Kind == "free" || Kind == "deallocator" || Kind == "allocator" || Kind.find("operator_delete") == 0 || Kind.find("realloc") == 0;
+  }
+
+  // A declared function as an origin stands for the result of calling it (see OriginTracer::expandLocal), which is only an allocation
+  // for allocators; a defined one can only be there as a function pointer, which is as static as a global.
+  bool isAllocating(Value *v) const {
+    auto handleFn = [&](Function *F) { return isAllocatorKind(kind(F)); };
+    auto handled = visitDyn<bool>(
+        v,                                           //
+        [&](PoisonValue *) { return true; },         //
+        [&](ConstantPointerNull *) { return true; }, //
+        [&](GlobalVariable *) { return true; },      //
+        [&](ConstantDataArray *) { return true; },   //
+        [&](AllocaInst *) { return true; },          //
+        [&](LandingPadInst *) { return true; },      //
+        [&](Function *F) { return !F->isDeclaration() || handleFn(F); },
+        [&](CallInst *Call) {
+          if (auto F = Call->getCalledFunction()) {
+            return handleFn(F);
+          }
+          return false;
+        },
+        [&](llvm::InvokeInst *Invoke) {
+          if (auto F = Invoke->getCalledFunction()) {
+            return handleFn(F);
+          }
+          return false;
+        });
+    return handled ? *handled : false;
+  }
+};
+
+enum class ReportFormat { YAML, JSONL, DB };
+
+struct ArgReport {
+  Value *arg;
+  size_t maxDepth, indirections, nonAllocOrigins;
+  bool truncated, inexact;
+  std::vector<const std::string *> origins; // labels, owned by the caller
+};
+
+// The text of the instructions a report quotes, cut out of a single print of the module. Printing an instruction on its own builds an
+// AssemblyWriter, which visits every global of the module, so printing each call, argument and origin that way is quadratic.
+class InstructionText : public AssemblyAnnotationWriter {
+  // Drops everything written, except while an instruction of interest is being printed.
+  class Capture : public raw_ostream {
+    uint64_t written{};
+    void write_impl(const char *Ptr, size_t Size) override {
+      if (into) into->append(Ptr, Size);
+      written += Size;
+    }
+    uint64_t current_pos() const override { return written; }
+
+  public:
+    std::string *into{};
+    Capture() { SetUnbuffered(); }
+  };
+
+  DenseMap<const Instruction *, std::string> text;
+  Capture capture;
+
+public:
+  using AssemblyAnnotationWriter::emitInstructionAnnot;
+  void emitInstructionAnnot(const Instruction *I, formatted_raw_ostream &OS) override {
+    OS.flush();
+    if (auto It = text.find(I); It != text.end()) capture.into = &It->second;
+  }
+  void printInfoComment(const Value &, formatted_raw_ostream &OS) override { // the end of the instruction, if one is being printed
+    OS.flush();
+    capture.into = nullptr;
+  }
+
+  InstructionText(Module &M, const DenseSet<const Instruction *> &Wanted) {
+    for (auto I : Wanted)
+      text.try_emplace(I);
+    M.print(capture, this);
+  }
+
+  // Instructions not asked for up front, and anything else, are printed on their own with MST.
+  void print(raw_ostream &OS, const Value &V, ModuleSlotTracker &MST) const {
+    if (auto I = dyn_cast<Instruction>(&V); I && text.count(I)) OS << text.find(I)->second;
+    else V.print(OS, MST);
+  }
+};
+
+void printArg(raw_ostream &out, Value *V, const InstructionText &Text, ModuleSlotTracker &MST) {
+  if (auto RF = dyn_cast<Function>(V)) out << RF->getName();
+  else Text.print(out, *V, MST);
 }
 
-enum class Kind { Stack, Heap, StdCall, LandingPad, Global, Constant, Null };
+void writeYAML(raw_ostream &out, CallBase &CI, const std::vector<ArgReport> &Args, const InstructionText &Text, ModuleSlotTracker &MST) {
+  out << "    - instruction: '";
+  Text.print(out, CI, MST);
+  out << "'\n";
+  out << "      args: \n";
+  for (auto &Arg : Args) {
+    out << "      - arg: '";
+    printArg(out, Arg.arg, Text, MST);
+    out << "'\n";
+    out << "        maxDepth: " << Arg.maxDepth << "\n";
+    out << "        indirections: " << Arg.indirections << "\n";
+    if (Arg.inexact) out << "        indirectionsInexact: true\n";
+    out << "        nonAllocOrigins: " << Arg.nonAllocOrigins << "\n";
+    if (Arg.truncated) out << "        truncated: true\n";
+    out << "        origins:\n";
+    for (auto Origin : Arg.origins)
+      out << "        - '" << *Origin << "'\n";
+  }
+}
 
-bool isAllocating(Value *v) {
-  auto handleFn = [&](Function *F) {
-    auto Name = F->getName();
-    if (AllocFunctions.find(Name.str()) != AllocFunctions.end()) return true;
-    if (auto CXXName = demangleCXXName(Name.data())) {
-      return CXXName->rfind("std::", 0) == 0;
+// One JSON object per line and call, with the same fields as the YAML report.
+void writeJSONL(raw_ostream &out, Function &F, CallBase &CI, const std::vector<ArgReport> &Args, const InstructionText &Text,
+                ModuleSlotTracker &MST) {
+  std::string Printed;
+  raw_string_ostream PrintedOS(Printed);
+  auto print = [&](auto f) -> StringRef {
+    Printed.clear();
+    f(PrintedOS);
+    return PrintedOS.str();
+  };
+  json::OStream J(out);
+  J.object([&]() {
+    J.attribute("function", F.getName());
+    J.attribute("instruction", print([&](auto &OS) { Text.print(OS, CI, MST); }));
+    J.attributeArray("args", [&]() {
+      for (auto &Arg : Args) {
+        J.object([&]() {
+          J.attribute("arg", print([&](auto &OS) { printArg(OS, Arg.arg, Text, MST); }));
+          J.attribute("maxDepth", Arg.maxDepth);
+          J.attribute("indirections", Arg.indirections);
+          if (Arg.inexact) J.attribute("indirectionsInexact", true);
+          J.attribute("nonAllocOrigins", Arg.nonAllocOrigins);
+          if (Arg.truncated) J.attribute("truncated", true);
+          J.attributeArray("origins", [&]() {
+            for (auto Origin : Arg.origins)
+              J.value(*Origin);
+          });
+        });
+      }
+    });
+  });
+  out << "\n";
+}
+
+namespace db = ptr_tracer::db;
+
+// One call of the report kept for writeDB, with everything printed that needs the chunk's slot trackers.
+struct CallRecord {
+  std::string instruction;
+  std::vector<std::string> args; // one per report
+  std::vector<ArgReport> reports;
+};
+
+// Writes the binary report, see report_db.h. Records holds the calls of each of Functions; origin labels are interned along with every
+// other string.
+void writeDB(raw_ostream &out, StringRef Module, ArrayRef<Function *> Functions, ArrayRef<std::vector<CallRecord>> Records) {
+  StringMap<uint32_t> Ids;
+  std::vector<StringRef> Strings;
+  auto intern = [&](StringRef S) {
+    auto [It, Inserted] = Ids.try_emplace(S, Strings.size());
+    if (Inserted) Strings.push_back(It->first());
+    return It->second;
+  };
+
+  db::Header Header{};
+  std::copy(std::begin(db::Magic), std::end(db::Magic), Header.magic);
+  Header.version = db::Version;
+  Header.module = intern(Module);
+  std::vector<db::Function> Fns;
+  std::vector<db::Call> Calls;
+  std::vector<db::Arg> Args;
+  std::vector<uint32_t> Origins;
+  for (size_t i = 0; i < Functions.size(); ++i) {
+    Fns.push_back({intern(Functions[i]->getName()), static_cast<uint32_t>(Calls.size()), static_cast<uint32_t>(Records[i].size())});
+    for (auto &Record : Records[i]) {
+      Calls.push_back({static_cast<uint32_t>(i), intern(Record.instruction), static_cast<uint32_t>(Args.size()),
+                       static_cast<uint32_t>(Record.reports.size())});
+      for (size_t a = 0; a < Record.reports.size(); ++a) {
+        auto &R = Record.reports[a];
+        Args.push_back({static_cast<uint32_t>(Calls.size() - 1), intern(Record.args[a]), static_cast<uint32_t>(R.maxDepth),
+                        static_cast<uint32_t>(R.indirections), static_cast<uint32_t>(R.nonAllocOrigins), R.truncated, R.inexact,
+                        static_cast<uint32_t>(Origins.size()), static_cast<uint32_t>(R.origins.size())});
+        for (auto Origin : R.origins)
+          Origins.push_back(intern(*Origin));
+      }
     }
-    return false;
+  }
+
+  std::vector<uint64_t> Offsets{0};
+  for (auto S : Strings)
+    Offsets.push_back(Offsets.back() + S.size());
+  auto sorted = [](size_t N, auto less) {
+    std::vector<uint32_t> Order(N);
+    std::iota(Order.begin(), Order.end(), 0);
+    std::stable_sort(Order.begin(), Order.end(), less);
+    return Order;
   };
-  auto handled = visitDyn<bool>(
-      v,                                           //
-      [&](PoisonValue *) { return true; },         //
-      [&](ConstantPointerNull *) { return true; }, //
-      [&](GlobalVariable *) { return true; },      //
-      [&](ConstantDataArray *) { return true; },   //
-      [&](AllocaInst *) { return true; },          //
-      [&](LandingPadInst *) { return true; },      //
-      [&](Function *) { return true; },            //
-      [&](CallInst *Call) {
-        if (auto F = Call->getCalledFunction()) {
-          return handleFn(F);
-        }
-        return false;
-      },
-      [&](llvm::InvokeInst *Invoke) {
-        if (auto F = Invoke->getCalledFunction()) {
-          return handleFn(F);
-        }
-        return false;
-      });
-  return handled ? *handled : false;
+  const auto ByName = sorted(Fns.size(), [&](uint32_t L, uint32_t R) { return Strings[Fns[L].name] < Strings[Fns[R].name]; });
+  const auto ByDepth = sorted(Args.size(), [&](uint32_t L, uint32_t R) { return Args[L].maxDepth > Args[R].maxDepth; });
+  const auto ByIndirections = sorted(Args.size(), [&](uint32_t L, uint32_t R) { return Args[L].indirections > Args[R].indirections; });
+  const auto ByNonAlloc = sorted(Args.size(), [&](uint32_t L, uint32_t R) { return Args[L].nonAllocOrigins > Args[R].nonAllocOrigins; });
+
+  // Lay the tables out after the header, then write them in the same order.
+  uint64_t End = sizeof(db::Header);
+  auto place = [&](db::Table &Table, uint64_t Count, size_t Size) {
+    Table = {alignTo(End, 8), Count};
+    End = Table.offset + Count * Size;
+  };
+  place(Header.strings, Strings.size(), sizeof(uint64_t)); // plus the final offset, written below
+  End += sizeof(uint64_t);
+  place(Header.chars, Offsets.back(), 1);
+  place(Header.functions, Fns.size(), sizeof(db::Function));
+  place(Header.byName, ByName.size(), sizeof(uint32_t));
+  place(Header.calls, Calls.size(), sizeof(db::Call));
+  place(Header.args, Args.size(), sizeof(db::Arg));
+  place(Header.origins, Origins.size(), sizeof(uint32_t));
+  place(Header.byDepth, ByDepth.size(), sizeof(uint32_t));
+  place(Header.byIndirections, ByIndirections.size(), sizeof(uint32_t));
+  place(Header.byNonAllocOrigins, ByNonAlloc.size(), sizeof(uint32_t));
+
+  uint64_t Written = 0;
+  auto write = [&](const db::Table &Table, const void *Data, size_t Bytes) {
+    out.write_zeros(Table.offset - Written);
+    out.write(static_cast<const char *>(Data), Bytes);
+    Written = Table.offset + Bytes;
+  };
+  out.write(reinterpret_cast<const char *>(&Header), sizeof(Header));
+  Written = sizeof(Header);
+  write(Header.strings, Offsets.data(), Offsets.size() * sizeof(uint64_t));
+  out.write_zeros(Header.chars.offset - Written);
+  for (auto S : Strings)
+    out << S;
+  Written = Header.chars.offset + Offsets.back();
+  write(Header.functions, Fns.data(), Fns.size() * sizeof(db::Function));
+  write(Header.byName, ByName.data(), ByName.size() * sizeof(uint32_t));
+  write(Header.calls, Calls.data(), Calls.size() * sizeof(db::Call));
+  write(Header.args, Args.data(), Args.size() * sizeof(db::Arg));
+  write(Header.origins, Origins.data(), Origins.size() * sizeof(uint32_t));
+  write(Header.byDepth, ByDepth.data(), ByDepth.size() * sizeof(uint32_t));
+  write(Header.byIndirections, ByIndirections.data(), ByIndirections.size() * sizeof(uint32_t));
+  write(Header.byNonAllocOrigins, ByNonAlloc.data(), ByNonAlloc.size() * sizeof(uint32_t));
 }
 
-bool runPtrTracer(Module &M, const std::string &ResultFile) {
+// Number of analysis threads: PTR_TRACER_JOBS, else the linker's --thinlto-jobs, else every hardware thread (0 means the same).
+unsigned analysisJobs() {
+  if (auto Jobs = getEnv("PTR_TRACER_JOBS")) return std::strtoul(Jobs->c_str(), nullptr, 10);
+  for (auto &Arg : getCmdLine()) {
+    StringRef Value(Arg);
+    if (Value.consume_front("--thinlto-jobs=") || Value.consume_front("-thinlto-jobs=") || Value.consume_front("/opt:lldltojobs=")) {
+      unsigned Jobs;
+      if (!Value.getAsInteger(10, Jobs)) return Jobs;
+    }
+  }
+  return 0;
+}
+
+#if LLVM_VERSION_MAJOR >= 19
+using AnalysisPool = DefaultThreadPool;
+#else
+using AnalysisPool = ThreadPool;
+#endif
+
+// Functions whose calls are the only ones traced and reported: those named in PTR_TRACER_TARGETS (comma separated symbols) and those
+// annotated with __attribute__((annotate("ptr_tracer_target"))). Nothing if neither is used, in which case every call is.
+std::optional<DenseSet<const Function *>> targetFunctions(Module &M) {
+  std::optional<DenseSet<const Function *>> Targets;
+  if (auto Names = getEnv("PTR_TRACER_TARGETS")) {
+    Targets.emplace();
+    SmallVector<StringRef, 8> Split;
+    StringRef(*Names).split(Split, ',', -1, false);
+    for (auto Name : Split) {
+      if (auto F = M.getFunction(Name.trim())) Targets->insert(F);
+      else errs() << "[PtrTracer] PTR_TRACER_TARGETS: no function named " << Name.trim() << " in " << M.getName() << "\n";
+    }
+  }
+  findFunctionsWithStringAnnotations(M, [&](Function *F, StringRef Annotation) {
+    if (Annotation != "ptr_tracer_target") return;
+    if (!Targets) Targets.emplace();
+    Targets->insert(F);
+  });
+  return Targets;
+}
+
+bool runPtrTracer(Module &M, LazyCallGraph &LCG, FunctionAnalysisManager &FAM, const std::string &ResultFile, ReportFormat Format) {
 
   // M.print(llvm::errs(), nullptr);
 
-  tee_ostream out(nulls(), ResultFile);
+  // Phases, with the report stitched back together in module order so the output doesn't depend on the number of threads:
+  //  1. serial: numbering and the bottom-up return summaries
+  //  2. parallel, per function: local origins of every pointer argument at every call
+  //  3. serial: resolution of whatever still depends on a caller's arguments, through the shared argument memo
+  //  4. parallel, per chunk of functions: the report fragments
+  // Budgets apply to each phase of a query separately. Node budgets per query keep the report deterministic, the others don't.
+  // With targets (see targetFunctions), only calls to them are traced, and return summaries are only built for the functions those
+  // calls and their callers depend on, as resolution reaches them; the summary cache is unused, as it stores every call of a function.
+  TraceLimits Limits;
+  auto budget = [&]() { return Limits.query(); };
 
-  out << "module:\n";
-  out << "  name: " << M.getName() << "\n";
-  out << "  functions: \n";
-  for (Function &F : M) {
-    out << "  - " << F.getName() << ":\n";
-    out << "    calls: \n";
+  // Wall time of each phase, written as JSON to PTR_TRACER_TIMINGS if set (see scaling.cpp).
+  std::vector<std::pair<const char *, double>> Timings;
+  auto Last = std::chrono::steady_clock::now();
+  auto phase = [&](const char *Name) {
+    const auto Now = std::chrono::steady_clock::now();
+    Timings.emplace_back(Name, std::chrono::duration<double, std::milli>(Now - Last).count());
+    Last = Now;
+  };
+
+  const auto Targets = targetFunctions(M);
+  auto targeted = [&](CallBase &CB) {
+    return !Targets || Targets->count(dyn_cast<Function>(CB.getCalledOperand()->stripPointerCastsAndAliases()));
+  };
+  std::optional<SummaryCache> Cache;
+  if (auto Dir = SummaryCache::directory(Limits); Dir && !Targets) Cache.emplace(*Dir);
+  OriginTracer Tracer(M, LCG, FAM, budget, Cache ? &*Cache : nullptr, Targets.has_value());
+
+  struct CallSite {
+    CallBase *call;
+    std::vector<std::pair<Value *, OriginSummary>> args;
+  };
+  // PTR_TRACER_SHARD=k/n reports only the k-th of n contiguous slices of the module's functions, see shard.cpp. Summaries still cover
+  // the whole module, so the slices concatenate to the report of a single run.
+  size_t Shard = 0, Shards = 1;
+  if (auto Spec = getEnv("PTR_TRACER_SHARD")) {
+    auto [K, N] = StringRef(*Spec).split('/');
+    if (K.getAsInteger(10, Shard) || N.getAsInteger(10, Shards) || !Shards || Shard >= Shards) {
+      errs() << "[PtrTracer] ignoring malformed PTR_TRACER_SHARD=" << *Spec << ", expecting <k>/<n> with k < n\n";
+      Shard = 0, Shards = 1;
+    }
+  }
+  std::vector<Function *> Functions;
+  for (Function &F : M)
+    if (!Targets || any_of(instructions(F), [&](Instruction &I) { return isa<CallBase>(I) && targeted(cast<CallBase>(I)); }))
+      Functions.push_back(&F);
+  Functions = std::vector<Function *>(Functions.begin() + Shard * Functions.size() / Shards,
+                                      Functions.begin() + (Shard + 1) * Functions.size() / Shards);
+  if (Targets)
+    for (auto F : Functions)
+      Tracer.prepare(*F);
+  phase("summaries");
+  std::vector<std::vector<CallSite>> Calls(Functions.size());
+  std::vector<std::string> Fragments(Functions.size());
 
-    auto report = [&](CallBase *CI) {
-      out << "    - instruction: '" << *CI << "'\n";
-      out << "      args: \n";
+  AnalysisPool Pool(hardware_concurrency(analysisJobs()));
+  auto parallel = [&](auto f) {
+    for (size_t i = 0; i < Functions.size(); ++i)
+      Pool.async([&f, i]() { f(i); });
+    Pool.wait();
+  };
 
-      for (size_t i = 0; i < CI->arg_size(); i++) {
-        auto V = CI->getArgOperandUse(i).get();
-        if (!V->getType()->isPointerTy()) continue;
-        std::vector<Value *> Results;
-        std::unordered_set<Value *> Visited;
-        auto depth = traceValueOrigin(V, Results, Visited);
+  std::vector<std::chrono::microseconds> Times(Functions.size());
+  parallel([&](size_t i) {
+    const auto Start = std::chrono::steady_clock::now();
+    auto Restored = Tracer.restored(*Functions[i]); // in the same order, as the cache key covers the function's structure
+    size_t Next = 0;
+    for (auto &I : instructions(*Functions[i])) {
+      if (auto *CB = dyn_cast<CallBase>(&I); CB && targeted(*CB)) {
+        auto &Site = Calls[i].emplace_back(CallSite{CB, {}});
+        for (size_t a = 0; a < CB->arg_size(); a++) {
+          auto V = CB->getArgOperandUse(a).get();
+          if (!V->getType()->isPointerTy()) continue;
+          if (Restored) {
+            Site.args.emplace_back(V, (*Restored)[Next++]);
+            continue;
+          }
+          auto Budget = budget();
+          Site.args.emplace_back(V, Tracer.local(V, Budget));
+        }
+      }
+    }
+    Times[i] = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - Start);
+  });
 
-        size_t nonAllocOrigins = std::count_if(Results.begin(), Results.end(), [](auto &v) { return !isAllocating(v); });
+  if (Cache) // before resolution, which depends on the callers
+    for (size_t i = 0; i < Functions.size(); ++i) {
+      std::vector<const OriginSummary *> Summaries;
+      for (auto &Site : Calls[i])
+        for (auto &[V, Summary] : Site.args)
+          Summaries.push_back(&Summary);
+      Tracer.store(*Functions[i], Summaries, Times[i]);
+    }
+  phase("local");
 
-        if (auto RF = dyn_cast<Function>(V)) {
-          out << "      - arg: '" << RF->getName() << "'\n";
-        } else {
-          out << "      - arg: '" << *V << "'\n";
+  for (auto &Sites : Calls)
+    for (auto &Site : Sites)
+      for (auto &[V, Summary] : Site.args)
+        if (!Summary.arguments.empty()) {
+          auto Budget = budget();
+          Summary = Tracer.resolve(Summary, Budget);
         }
+  phase("resolve");
 
-        out << "        maxDepth: " << depth << "\n";
-        out << "        indirections: " << Visited.size() << "\n";
-        out << "        nonAllocOrigins: " << nonAllocOrigins << "\n";
-        out << "        origins:\n";
-        for (auto R : Results) {
+  // Instructions are quoted from one print of the module, see InstructionText. Printing anything else on its own builds a slot tracker
+  // over its whole function (or module), so each chunk of functions shares one tracker for the function being reported and one for
+  // origins elsewhere, and labels every origin once.
+  DenseSet<const Instruction *> Quoted;
+  for (auto &Sites : Calls)
+    for (auto &Site : Sites) {
+      Quoted.insert(Site.call);
+      for (auto &[V, Summary] : Site.args) {
+        if (auto I = dyn_cast<Instruction>(V)) Quoted.insert(I);
+        for (auto Origin : Summary.origins)
+          if (auto I = dyn_cast<Instruction>(Tracer.value(Origin))) Quoted.insert(I);
+      }
+    }
+  const InstructionText Text(M, Quoted);
+  const size_t Chunks = std::min<size_t>(Functions.size(), Pool.getThreadCount() * 4);
+  std::atomic<size_t> Truncated{};
+  const Allocators Kinds(M);
+  std::vector<std::unordered_map<unsigned, std::string>> ChunkLabels(Chunks); // kept for the database writer
+  std::vector<std::vector<CallRecord>> Records(Format == ReportFormat::DB ? Functions.size() : 0);
+  for (size_t c = 0; c < Chunks; ++c) {
+    Pool.async([&, c]() {
+      ModuleSlotTracker Local(&M, false), Foreign(&M, false);
+      auto &Labels = ChunkLabels[c];
+      auto label = [&](unsigned Origin) -> const std::string & {
+        auto [It, Inserted] = Labels.try_emplace(Origin);
+        if (Inserted) {
+          raw_string_ostream OS(It->second);
+          auto R = Tracer.value(Origin);
           if (auto RF = dyn_cast<Function>(R)) {
-            out << "        - '" << RF->getName() << "'\n";
+            OS << RF->getName();
           } else if (auto I = dyn_cast<Instruction>(R)) {
-            out << "        - '" << (*R) << " (in " << I->getFunction()->getName() << ")'\n";
+            Text.print(OS, *I, Foreign);
+            OS << " (in " << I->getFunction()->getName() << ")";
           } else {
-            out << "        - '" << (*R) << "'\n";
+            R->print(OS, Foreign);
           }
         }
+        return It->second;
+      };
+      for (size_t i = c * Functions.size() / Chunks; i < (c + 1) * Functions.size() / Chunks; ++i) {
+        raw_string_ostream out(Fragments[i]);
+        Local.incorporateFunction(*Functions[i]);
+        if (Format == ReportFormat::YAML) {
+          out << "  - " << Functions[i]->getName() << ":\n";
+          out << "    calls: \n";
+        }
+        for (auto &Site : Calls[i]) {
+          std::vector<ArgReport> Args;
+          for (auto &[V, Summary] : Site.args) {
+            auto &Arg = Args.emplace_back(ArgReport{V, Summary.depth, Summary.indirections, 0, Summary.truncated, Summary.inexact, {}});
+            Truncated += Summary.truncated;
+            for (auto Origin : Summary.origins) {
+              Arg.origins.push_back(&label(Origin));
+              if (!Kinds.isAllocating(Tracer.value(Origin))) Arg.nonAllocOrigins++;
+            }
+          }
+          if (Format == ReportFormat::YAML) writeYAML(out, *Site.call, Args, Text, Local);
+          else if (Format == ReportFormat::JSONL) writeJSONL(out, *Functions[i], *Site.call, Args, Text, Local);
+          else {
+            auto &Record = Records[i].emplace_back();
+            raw_string_ostream Instruction(Record.instruction);
+            Text.print(Instruction, *Site.call, Local);
+            for (auto &Arg : Args) {
+              raw_string_ostream OS(Record.args.emplace_back());
+              printArg(OS, Arg.arg, Text, Local);
+            }
+            Record.reports = std::move(Args);
+          }
+        }
+        Calls[i].clear();
       }
-    };
+    });
+  }
+  Pool.wait();
+  phase("report");
+
+  if (Format == ReportFormat::DB) {
+    std::error_code EC;
+    raw_fd_ostream out(ResultFile, EC);
+    if (EC) errs() << "Error: Unable to open file " << ResultFile << ": " << EC.message() << "\n";
+    else writeDB(out, M.getName(), Functions, Records);
+  }
+  tee_ostream out(nulls(), Format == ReportFormat::DB ? std::nullopt : std::optional(ResultFile));
+  if (Format == ReportFormat::YAML) {
+    out << "module:\n";
+    out << "  name: " << M.getName() << "\n";
+    out << "  functions: \n";
+  } else if (Format == ReportFormat::JSONL) {
+    json::OStream J(out);
+    J.object([&]() { J.attribute("module", M.getName()); });
+    out << "\n";
+  }
+  for (auto &Fragment : Fragments)
+    out << Fragment;
+  out.flush();
+  phase("write");
+  if (auto Path = getEnv("PTR_TRACER_TIMINGS")) {
+    tee_ostream TimingsOut(nulls(), *Path);
+    json::OStream J(TimingsOut);
+    J.object([&]() {
+      J.attribute("functions", static_cast<int64_t>(M.size()));
+      J.attribute("instructions", static_cast<int64_t>(M.getInstructionCount()));
+      J.attributeObject("phasesMs", [&]() {
+        for (auto &[Name, Ms] : Timings)
+          J.attribute(Name, Ms);
+      });
+    });
+  }
+  if (Truncated)
+    errs() << "[PtrTracer] " << Truncated << " pointer arguments were only partially traced, see `truncated` in " << ResultFile << "\n";
+  if (Cache) Cache->finish();
 
-    for (BasicBlock &BB : F) {
-      for (Instruction &I : BB) {
-        if (auto *CB = dyn_cast<CallBase>(&I)) {
-          report(CB);
+  return false;
+}
+
+// Where a report for M goes: next to the link output, named <prefix><output>_<N>g<N>f<N>a<N>i<extension>.
+std::string reportPath(Module &M, const std::string &prefix, const std::string &extension) {
+  std::string ModuleSuffix;
+  ModuleSuffix += std::to_string(M.global_size()) + "g";
+  ModuleSuffix += std::to_string(M.size()) + "f";
+  ModuleSuffix += std::to_string(M.alias_size()) + "a";
+  ModuleSuffix += std::to_string(M.ifunc_size()) + "i";
+
+  std::filesystem::path OutputName = guessOutputName().value_or(M.getSourceFileName());
+  return (OutputName.has_relative_path() ? OutputName.parent_path() : "./") /
+         (prefix + OutputName.filename().string() + "_" + ModuleSuffix + extension);
+}
+
+// Finds why a pointer may outlive the function it was allocated in, following it into defined callees (memoised per parameter).
+class EscapeAnalysis {
+  const Allocators &kinds;
+  DenseMap<const Argument *, std::optional<std::string>> parameters; // escape reason, if any
+
+public:
+  explicit EscapeAnalysis(const Allocators &kinds) : kinds(kinds) {}
+
+  // Returns why V escapes, or nothing. Frees of V itself are collected into Frees if given, and are an escape otherwise: a callee
+  // freeing the pointer would free stack memory once it is promoted.
+  std::optional<std::string> escapes(Value *V, SmallVectorImpl<CallBase *> *Frees) {
+    SmallVector<Use *, 16> Worklist;
+    SmallPtrSet<Value *, 16> Seen{V};
+    for (auto &U : V->uses())
+      Worklist.push_back(&U);
+    while (!Worklist.empty()) {
+      auto &U = *Worklist.pop_back_val();
+      auto User = U.getUser();
+      if (isa<GetElementPtrInst>(User) || isa<BitCastInst>(User) || isa<AddrSpaceCastInst>(User)) {
+        if (Seen.insert(User).second)
+          for (auto &Next : User->uses())
+            Worklist.push_back(&Next);
+        continue;
+      }
+      if (isa<LoadInst>(User) || isa<ICmpInst>(User)) continue;
+      if (auto S = dyn_cast<StoreInst>(User)) {
+        if (U.getOperandNo() == S->getPointerOperandIndex()) continue;
+        return "stored to memory";
+      }
+      if (isa<PHINode>(User) || isa<SelectInst>(User))
+        return "merged with other pointers by a " + std::string(cast<Instruction>(User)->getOpcodeName());
+      if (isa<ReturnInst>(User)) return "returned";
+      if (auto CB = dyn_cast<CallBase>(User)) {
+        if (CB->isCallee(&U)) return "called";
+        const auto Kind = kinds.kind(CB->getCalledFunction());
+        if (Kind == "free" || Kind.find("operator_delete") == 0) {
+          if (!Frees || U.get() != V || U.getOperandNo() != 0) return "freed by " + CB->getCalledFunction()->getName().str() + " elsewhere";
+          if (isa<InvokeInst>(CB)) return "freed by an invoke";
+          Frees->push_back(CB);
+          continue;
         }
+        if (isa<DbgInfoIntrinsic>(CB) || CB->isLifetimeStartOrEnd()) continue;
+        if (!CB->isArgOperand(&U)) return "used as a bundle operand";
+        const auto ArgNo = CB->getArgOperandNo(&U);
+        if (CB->paramHasAttr(ArgNo, Attribute::Returned)) return "returned by a call";
+        auto Callee = CB->getCalledFunction();
+        // Only a body that is the one which runs tells anything, not one the linker may replace (weak, linkonce_odr, ...).
+        if (Callee && !Callee->isDeclaration() && Callee->isDefinitionExact() && ArgNo < Callee->arg_size()) {
+          if (auto Reason = escapes(Callee->getArg(ArgNo))) return "passed to " + Callee->getName().str() + ", where it is " + *Reason;
+          continue;
+        }
+        if (CB->doesNotCapture(ArgNo) && (CB->hasFnAttr(Attribute::NoFree) || CB->paramHasAttr(ArgNo, Attribute::NoFree))) continue;
+        if (Callee && !Callee->isDeclaration()) return "passed to " + Callee->getName().str() + ", which may be replaced at link time";
+        return "passed to " + (Callee ? Callee->getName().str() : std::string("an indirect call"));
       }
+      return "used by " + std::string(cast<Instruction>(User)->getOpcodeName());
     }
+    return {};
   }
-  out.flush();
 
+  std::optional<std::string> escapes(Argument *A) {
+    if (auto It = parameters.find(A); It != parameters.end()) return It->second;
+    parameters[A] = "passed around recursively"; // until proven otherwise
+    auto Reason = escapes(A, nullptr);
+    parameters[A] = Reason;
+    return Reason;
+  }
+};
+
+// Replaces heap allocations of small constant (or bounded) size whose pointer never outlives the allocating function with a stack slot
+// in the entry block, and deletes their frees. Allocations in loops are fine: a pointer that doesn't escape and isn't merged by a PHI
+// can't be live across iterations, so each iteration can reuse the slot. Every candidate is listed in a promote_*.yaml report.
+struct PtrTracerPromote : PassInfoMixin<PtrTracerPromote> {
+  PreservedAnalyses run(Module &M, ModuleAnalysisManager &) {
+    const auto MaxSize = getEnvUnsigned("PTR_TRACER_PROMOTE_MAX", 1024), MaxFrame = getEnvUnsigned("PTR_TRACER_PROMOTE_FRAME", 8192);
+    tee_ostream out(nulls(), reportPath(M, "promote_", ".yaml"));
+    out << "module:\n";
+    out << "  name: " << M.getName() << "\n";
+    out << "  sites: \n";
+
+    const Allocators Kinds(M);
+    EscapeAnalysis Escapes(Kinds);
+    size_t Promoted = 0, Rejected = 0;
+    for (auto &F : M) {
+      if (F.isDeclaration()) continue;
+      std::vector<CallBase *> Candidates;
+      for (auto &I : instructions(F))
+        if (auto CB = dyn_cast<CallBase>(&I)) {
+          const auto Kind = Kinds.kind(CB->getCalledFunction());
+          if (Kind == "malloc" || Kind == "calloc" || Kind == "aligned_alloc" || Kind == "operator_new" || Kind == "operator_new_nothrow")
+            Candidates.push_back(CB);
+        }
+
+      uint64_t Frame = 0;
+      for (auto CB : Candidates) {
+        const auto Kind = Kinds.kind(CB->getCalledFunction());
+        out << "  - function: " << F.getName() << "\n";
+        out << "    site: '" << *CB << "'\n";
+
+        // Size and alignment operands per allocator kind; malloc and new are good for any fundamental alignment.
+        auto constant = [](Value *V) -> std::optional<uint64_t> {
+          if (auto C = dyn_cast<ConstantInt>(V)) return C->getZExtValue();
+          const auto Range = computeConstantRange(V, false);
+          if (Range.isFullSet() || Range.getUnsignedMax().getActiveBits() > 64) return {};
+          return Range.getUnsignedMax().getZExtValue();
+        };
+        std::optional<uint64_t> Size, Alignment = 16;
+        if (Kind == "calloc") {
+          if (auto N = constant(CB->getArgOperand(0)), Each = constant(CB->getArgOperand(1)); N && Each) Size = SaturatingMultiply(*N, *Each);
+        } else if (Kind == "aligned_alloc") {
+          Size = constant(CB->getArgOperand(1));
+          auto A = dyn_cast<ConstantInt>(CB->getArgOperand(0));
+          Alignment = A && isPowerOf2_64(A->getZExtValue()) ? std::optional<uint64_t>(A->getZExtValue()) : std::nullopt;
+        } else {
+          Size = constant(CB->getArgOperand(0));
+        }
+
+        SmallVector<CallBase *, 4> Frees;
+        std::optional<std::string> Reason;
+        if (!Size) Reason = "size is not a constant or bounded";
+        else if (!Alignment) Reason = "alignment is not a constant power of two";
+        else if (*Size > MaxSize) Reason = "size " + std::to_string(*Size) + " exceeds PTR_TRACER_PROMOTE_MAX";
+        else if (Frame + *Size > MaxFrame) Reason = "frame would exceed PTR_TRACER_PROMOTE_FRAME";
+        else Reason = Escapes.escapes(CB, &Frees);
+        if (Size) out << "    size: " << *Size << "\n";
+        if (Reason) {
+          out << "    promoted: false\n";
+          out << "    reason: '" << *Reason << "'\n";
+          Rejected++;
+          continue;
+        }
+        out << "    promoted: true\n";
+        out << "    frees: " << Frees.size() << "\n";
+        Promoted++;
+
+        const uint64_t Bytes = std::max<uint64_t>(*Size, 1);
+        Frame += Bytes;
+        IRBuilder<> Entry(&*F.getEntryBlock().getFirstInsertionPt());
+        auto Slot = Entry.CreateAlloca(ArrayType::get(Entry.getInt8Ty(), Bytes), nullptr, CB->getName() + ".stack");
+        Slot->setAlignment(Align(*Alignment));
+        IRBuilder<> At(CB);
+        At.CreateLifetimeStart(Slot, At.getInt64(Bytes));
+        if (Kind == "calloc") At.CreateMemSet(Slot, At.getInt8(0), Bytes, Align(*Alignment));
+        CB->replaceAllUsesWith(At.CreatePointerCast(Slot, CB->getType()));
+        for (auto Free : Frees) {
+          IRBuilder<>(Free).CreateLifetimeEnd(Slot, At.getInt64(Bytes));
+          Free->eraseFromParent();
+        }
+        if (auto II = dyn_cast<InvokeInst>(CB)) {
+          BranchInst::Create(II->getNormalDest(), II);
+          II->getUnwindDest()->removePredecessor(II->getParent());
+        }
+        CB->eraseFromParent();
+      }
+    }
+    out.flush();
+    errs() << "[PtrTracer] promoted " << Promoted << " of " << Promoted + Rejected << " heap allocations to the stack\n";
+    return Promoted ? PreservedAnalyses::none() : PreservedAnalyses::all();
+  }
+};
+
+// What a call site proves about one of its pointer arguments, as attributes the callee's parameter could carry.
+struct ParamFacts {
+  bool noAlias{};
+  uint64_t dereferenceable{}, dereferenceableOrNull{}, align{};
+
+  auto key() const { return std::tie(noAlias, dereferenceable, dereferenceableOrNull, align); }
+  bool operator==(const ParamFacts &that) const { return key() == that.key(); }
+  bool operator!=(const ParamFacts &that) const { return key() != that.key(); }
+  bool operator<(const ParamFacts &that) const { return key() < that.key(); }
+
+  // The facts that hold at both call sites.
+  ParamFacts meet(const ParamFacts &that) const {
+    ParamFacts Both;
+    Both.noAlias = noAlias && that.noAlias;
+    Both.dereferenceable = std::min(dereferenceable, that.dereferenceable);
+    Both.dereferenceableOrNull = std::min(std::max(dereferenceable, dereferenceableOrNull), //
+                                          std::max(that.dereferenceable, that.dereferenceableOrNull));
+    if (Both.dereferenceableOrNull <= Both.dereferenceable) Both.dereferenceableOrNull = 0;
+    Both.align = std::min(align, that.align);
+    return Both;
+  }
+};
+
+// Whether To can run after From without From running again in between, with Avoid not running in between either.
+bool reachesAvoiding(const Instruction *From, const Instruction *To, const Instruction *Avoid) {
+  SmallVector<const BasicBlock *, 16> Worklist;
+  SmallPtrSet<const BasicBlock *, 16> Visited;
+  auto scan = [&](const BasicBlock *BB, BasicBlock::const_iterator I) {
+    for (; I != BB->end(); ++I) {
+      if (&*I == To) return true;
+      if (&*I == Avoid || &*I == From) return false;
+    }
+    Worklist.append(succ_begin(BB), succ_end(BB));
+    return false;
+  };
+  if (scan(From->getParent(), std::next(From->getIterator()))) return true;
+  while (!Worklist.empty())
+    if (auto BB = Worklist.pop_back_val(); Visited.insert(BB).second && scan(BB, BB->begin())) return true;
   return false;
 }
 
+// The calls in F that may end the lifetime of an allocation: lifetime.end markers and calls of a freeing kind, see Allocators.
+std::vector<CallBase *> releasesIn(Function &F, const Allocators &Kinds) {
+  std::vector<CallBase *> Releases;
+  for (auto &I : instructions(F))
+    if (auto CB = dyn_cast<CallBase>(&I)) {
+      auto II = dyn_cast<IntrinsicInst>(CB);
+      if ((II && II->getIntrinsicID() == Intrinsic::lifetime_end) || Allocators::isFreeingKind(Kinds.kind(CB->getCalledFunction())))
+        Releases.push_back(CB);
+    }
+  return Releases;
+}
+
+// Whether Allocation is certainly still live at CB: none of Releases (see releasesIn) that may be given it can run between the two.
+// Once the allocation is captured, a release of any pointer loaded back from memory (or otherwise not identifiably another object) may
+// be given it.
+bool liveAt(Instruction *Allocation, CallBase &CB, ArrayRef<CallBase *> Releases) {
+  std::optional<bool> Captured;
+  auto mayBeGiven = [&](Value *Ptr) {
+    SmallVector<const Value *, 4> Objects;
+    getUnderlyingObjects(Ptr, Objects, nullptr, 0);
+    return any_of(Objects, [&](const Value *Object) {
+      if (Object == Allocation) return true;
+      if (isa<Argument>(Object) || isIdentifiedObject(Object)) return false;
+      if (!Captured) Captured = PointerMayBeCaptured(Allocation, false, true);
+      return *Captured;
+    });
+  };
+  for (auto Release : Releases) {
+    if (none_of(Release->args(), [&](Use &Arg) { return Arg->getType()->isPointerTy() && mayBeGiven(Arg.get()); })) continue;
+    if (reachesAvoiding(Allocation, Release, &CB) && reachesAvoiding(Release, &CB, Allocation)) return false;
+  }
+  return true;
+}
+
+// The functions that may free memory, directly or through anything they call. A function counts as not freeing if it is `nofree` or if it
+// is an exact definition whose calls all go to functions that don't free; declarations and definitions that may be replaced at link time
+// only count if they are `nofree`.
+DenseSet<const Function *> mayFree(Module &M) {
+  DenseSet<const Function *> Freeing;
+  DenseMap<const Function *, SmallVector<const Function *, 4>> Callers;
+  SmallVector<const Function *, 16> Worklist;
+  auto mark = [&](const Function *F) {
+    if (Freeing.insert(F).second) Worklist.push_back(F);
+  };
+  for (auto &F : M) {
+    if (F.hasFnAttribute(Attribute::NoFree)) continue;
+    if (F.isDeclaration() || !F.isDefinitionExact()) {
+      mark(&F);
+      continue;
+    }
+    for (auto &I : instructions(F))
+      if (auto CB = dyn_cast<CallBase>(&I); CB && !CB->hasFnAttr(Attribute::NoFree)) {
+        if (auto Callee = CB->getCalledFunction()) Callers[Callee].push_back(&F);
+        else mark(&F);
+      }
+  }
+  while (!Worklist.empty())
+    if (auto It = Callers.find(Worklist.pop_back_val()); It != Callers.end())
+      for (auto Caller : It->second)
+        mark(Caller);
+  return Freeing;
+}
+
+// Facts hold for an argument that is a constant in-bounds offset into a fresh allocation (alloca or allocation call) of known size made in
+// the calling function, as long as nothing can free it (or end its lifetime) between the allocation and the call. LLVM takes
+// dereferenceable to hold for the whole call, so that one also needs the callee to not free the parameter (see mayFree). Being noalias
+// additionally needs the allocation to not have been captured before the call, and every other pointer argument to either be a different
+// fresh allocation or have origins that exclude this one (calls to declared functions are traced to the function, so an allocation
+// function among them counts as possibly this allocation).
+std::vector<ParamFacts> factsAt(CallBase &CB, OriginTracer &Tracer, TraceLimits &Limits, DominatorTree &DT, const TargetLibraryInfo &TLI,
+                                ArrayRef<CallBase *> Releases, const DenseSet<const Function *> &Freeing) {
+  const auto &DL = CB.getModule()->getDataLayout();
+  std::vector<ParamFacts> Facts(CB.arg_size());
+  std::vector<Instruction *> Fresh(CB.arg_size());
+  std::vector<APInt> Offsets(CB.arg_size());
+  for (size_t i = 0; i < CB.arg_size(); ++i) {
+    auto V = CB.getArgOperand(i);
+    if (!V->getType()->isPointerTy()) continue;
+    Offsets[i] = APInt(DL.getIndexTypeSizeInBits(V->getType()), 0);
+    if (auto I = dyn_cast<Instruction>(V->stripAndAccumulateInBoundsConstantOffsets(DL, Offsets[i]));
+        I && I->getFunction() == CB.getFunction() && (isa<AllocaInst>(I) || isAllocationFn(I, &TLI)))
+      Fresh[i] = I;
+  }
+  auto mayBe = [&](size_t j, Instruction *Allocation) {
+    if (Fresh[j]) return Fresh[j] == Allocation;
+    auto Budget = Limits.query();
+    const auto Origins = Tracer.resolve(Tracer.local(CB.getArgOperand(j), Budget), Budget);
+    if (Origins.truncated) return true;
+    auto Allocator = isa<CallBase>(Allocation) ? cast<CallBase>(Allocation)->getCalledFunction() : nullptr;
+    for (auto Origin : Origins.origins)
+      if (auto O = Tracer.value(Origin); O == Allocation || O == Allocator) return true;
+    return false;
+  };
+  for (size_t i = 0; i < CB.arg_size(); ++i) {
+    uint64_t Size;
+    if (!Fresh[i] || !getObjectSize(Fresh[i], Size, DL, &TLI) || Offsets[i].isNegative() || Offsets[i].getZExtValue() >= Size ||
+        !liveAt(Fresh[i], CB, Releases))
+      continue;
+    auto &P = Facts[i];
+    const auto Offset = Offsets[i].getZExtValue();
+    if (!Freeing.contains(CB.getCalledFunction()) || CB.paramHasAttr(i, Attribute::NoFree)) {
+      if (isa<AllocaInst>(Fresh[i]) || cast<CallBase>(Fresh[i])->hasRetAttr(Attribute::NonNull)) P.dereferenceable = Size - Offset;
+      else P.dereferenceableOrNull = Size - Offset;
+    }
+    P.align = commonAlignment(Fresh[i]->getPointerAlignment(DL), Offset).value();
+    P.noAlias = !PointerMayBeCapturedBefore(Fresh[i], true, true, &CB, &DT);
+    for (size_t j = 0; P.noAlias && j < CB.arg_size(); ++j)
+      if (j != i && CB.getArgOperand(j)->getType()->isPointerTy() && mayBe(j, Fresh[i])) P.noAlias = false;
+  }
+  return Facts;
+}
+
+// Adds the facts to F's parameters where they are stronger than what F already has, returns the number of attributes added.
+size_t addFacts(Function &F, ArrayRef<ParamFacts> Facts) {
+  size_t Added = 0;
+  for (unsigned i = 0; i < std::min<size_t>(F.arg_size(), Facts.size()); ++i) {
+    auto &P = Facts[i];
+    if (P.noAlias && !F.hasParamAttribute(i, Attribute::NoAlias)) F.addParamAttr(i, Attribute::NoAlias), Added++;
+    if (P.dereferenceable > F.getParamDereferenceableBytes(i)) F.addDereferenceableParamAttr(i, P.dereferenceable), Added++;
+    else if (P.dereferenceableOrNull > std::max(F.getParamDereferenceableBytes(i), F.getParamDereferenceableOrNullBytes(i)))
+      F.addDereferenceableOrNullParamAttr(i, P.dereferenceableOrNull), Added++;
+    if (P.align > 1 && P.align > F.getParamAlign(i).valueOrOne().value())
+      F.addParamAttr(i, Attribute::getWithAlignment(F.getContext(), Align(P.align))), Added++;
+  }
+  return Added;
+}
+
+// Turns origins into attributes on callee parameters, so the LTO optimisation pipeline that follows can vectorise and forward loads and
+// stores across calls it otherwise can't see through. Internal functions that are only called directly get whatever holds at all of their
+// call sites; call sites that prove more get a specialised clone, up to PTR_TRACER_MAX_CLONES per function with the most common first.
+struct PtrTracerAnnotate : PassInfoMixin<PtrTracerAnnotate> {
+  PreservedAnalyses run(Module &M, ModuleAnalysisManager &MAM) {
+    auto &FAM = MAM.getResult<FunctionAnalysisManagerModuleProxy>(M).getManager();
+    TraceLimits Limits;
+    OriginTracer Tracer(M, MAM.getResult<LazyCallGraphAnalysis>(M), FAM, [&]() { return Limits.query(); });
+    const auto MaxClones = getEnvUnsigned("PTR_TRACER_MAX_CLONES", 2);
+
+    const Allocators Kinds(M);
+    const auto Freeing = mayFree(M);
+    MapVector<Function *, std::vector<std::pair<CallBase *, std::vector<ParamFacts>>>> Sites;
+    for (auto &F : M) {
+      if (F.isDeclaration()) continue;
+      auto &DT = FAM.getResult<DominatorTreeAnalysis>(F);
+      auto &TLI = FAM.getResult<TargetLibraryAnalysis>(F);
+      const auto Releases = releasesIn(F, Kinds);
+      for (auto &I : instructions(F))
+        if (auto CB = dyn_cast<CallBase>(&I))
+          if (auto Callee = CB->getCalledFunction(); Callee && !Callee->isDeclaration() && !Callee->isVarArg())
+            Sites[Callee].emplace_back(CB, factsAt(*CB, Tracer, Limits, DT, TLI, Releases, Freeing));
+    }
+
+    size_t Annotated = 0, Cloned = 0, Redirected = 0;
+    for (auto &[F, Calls] : Sites) {
+      std::vector<ParamFacts> Common(F->arg_size());
+      if (F->hasLocalLinkage() && !F->hasAddressTaken()) {
+        Common = Calls.front().second;
+        for (auto &[CB, Facts] : Calls)
+          for (size_t i = 0; i < Common.size(); ++i)
+            Common[i] = Common[i].meet(Facts[i]);
+        Annotated += addFacts(*F, Common);
+      }
+
+      std::map<std::vector<ParamFacts>, std::vector<CallBase *>> Groups;
+      std::vector<const std::vector<ParamFacts> *> Order; // groups in order of first appearance, so ties break the same way every time
+      for (auto &[CB, Facts] : Calls) {
+        if (Facts == Common) continue;
+        auto [It, Inserted] = Groups.try_emplace(Facts);
+        if (Inserted) Order.push_back(&It->first);
+        It->second.push_back(CB);
+      }
+      std::stable_sort(Order.begin(), Order.end(), [&](auto L, auto R) { return Groups[*L].size() > Groups[*R].size(); });
+      for (auto Facts : llvm::make_range(Order.begin(), Order.begin() + std::min<size_t>(Order.size(), MaxClones))) {
+        ValueToValueMapTy VMap;
+        auto Clone = CloneFunction(F, VMap);
+        Clone->setName(F->getName() + ".ptrtracer");
+        Clone->setLinkage(GlobalValue::InternalLinkage);
+        Clone->setVisibility(GlobalValue::DefaultVisibility);
+        addFacts(*Clone, *Facts);
+        for (auto CB : Groups[*Facts])
+          CB->setCalledFunction(Clone), Redirected++;
+        Cloned++;
+      }
+    }
+
+    errs() << "[PtrTracer] added " << Annotated << " parameter attributes, " << Cloned << " specialised clones for " << Redirected
+           << " call sites\n";
+    return Annotated || Cloned ? PreservedAnalyses::none() : PreservedAnalyses::all();
+  }
+};
+
 struct PtrTracer : PassInfoMixin<PtrTracer> {
   std::string prefix;
   explicit PtrTracer(const std::string &prefix) : prefix(prefix) {}
 
   PreservedAnalyses run(Module &M, ModuleAnalysisManager &MAM) {
-    // LazyCallGraph &LCG = MAM.getResult<LazyCallGraphAnalysis>(M);
-
-    std::string ModuleSuffix;
-    ModuleSuffix += std::to_string(M.global_size()) + "g";
-    ModuleSuffix += std::to_string(M.size()) + "f";
-    ModuleSuffix += std::to_string(M.alias_size()) + "a";
-    ModuleSuffix += std::to_string(M.ifunc_size()) + "i";
+    LazyCallGraph &LCG = MAM.getResult<LazyCallGraphAnalysis>(M);
 
-    std::filesystem::path OutputName = guessOutputName().value_or(M.getSourceFileName());
-    auto Output = (OutputName.has_relative_path() ? OutputName.parent_path() : "./") /
-                  (prefix + OutputName.filename().string() + "_" + ModuleSuffix + ".yaml");
+    const auto Name = getEnv("PTR_TRACER_FORMAT").value_or("yaml");
+    const auto Format = Name == "jsonl" ? ReportFormat::JSONL : Name == "db" ? ReportFormat::DB : ReportFormat::YAML;
+    const char *Extension = Format == ReportFormat::JSONL ? ".jsonl" : Format == ReportFormat::DB ? ".ptdb" : ".yaml";
+    auto Output = getEnv("PTR_TRACER_OUTPUT").value_or(reportPath(M, prefix, Extension));
 
-    if (!runPtrTracer(M, Output)) return PreservedAnalyses::all();
+    auto &FAM = MAM.getResult<FunctionAnalysisManagerModuleProxy>(M).getManager();
+    if (!runPtrTracer(M, LCG, FAM, Output, Format)) return PreservedAnalyses::all();
     return PreservedAnalyses::none();
   }
 };
@@ -315,16 +2132,21 @@ llvm::PassPluginLibraryInfo getPtrTracerPluginInfo() {
   return {LLVM_PLUGIN_API_VERSION, "PtrTracer", LLVM_VERSION_STRING, [](PassBuilder &PB) {
             // PB.registerFullLinkTimeOptimizationEarlyEPCallback(
             //     [](llvm::ModulePassManager &MPM, OptimizationLevel Level) { MPM.addPass(PtrTracer("early_")); });
+            PB.registerFullLinkTimeOptimizationEarlyEPCallback([](llvm::ModulePassManager &MPM, OptimizationLevel) {
+              if (getEnv("PTR_TRACER_PROMOTE")) MPM.addPass(PtrTracerPromote());
+              if (getEnv("PTR_TRACER_ANNOTATE")) MPM.addPass(PtrTracerAnnotate());
+            });
             PB.registerFullLinkTimeOptimizationLastEPCallback(
                 [](llvm::ModulePassManager &MPM, OptimizationLevel) { MPM.addPass(PtrTracer("last_")); });
-            // PB.registerPipelineParsingCallback(
-            //     [](StringRef Name, llvm::FunctionPassManager &PM, ArrayRef<llvm::PassBuilder::PipelineElement>) {
-            //       if (Name == "ptrtracer") {
-            //         PM.addPass(Bye());
-            //         return true;
-            //       }
-            //       return false;
-            //     });
+            // For opt and the shard driver: -passes=ptrtracer, ptrtracer-promote or ptrtracer-annotate.
+            PB.registerPipelineParsingCallback(
+                [](StringRef Name, llvm::ModulePassManager &MPM, ArrayRef<llvm::PassBuilder::PipelineElement>) {
+                  if (Name == "ptrtracer") MPM.addPass(PtrTracer(""));
+                  else if (Name == "ptrtracer-promote") MPM.addPass(PtrTracerPromote());
+                  else if (Name == "ptrtracer-annotate") MPM.addPass(PtrTracerAnnotate());
+                  else return false;
+                  return true;
+                });
           }};
 }
 
@@ -0,0 +1,211 @@
+// Queries a binary ptr-tracer report (PTR_TRACER_FORMAT=db) in place: the file is mapped and only the tables a query needs are touched.
+// Usage: query <report.ptdb> [--functions] [--function <name>] [--by depth|indirections|nonalloc] [--top <n>]
+//                            [--min-depth <n>] [--min-indirections <n>] [--min-nonalloc <n>] [--truncated] [--origins]
+// Prints one line per pointer argument: function, counts, argument and call. --functions lists functions and their call counts instead.
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "report_db.h"
+
+using namespace ptr_tracer;
+
+class Report {
+  const char *base;
+  size_t size;
+  const db::Header &header;
+
+public:
+  Report(const char *base, size_t size) : base(base), size(size), header(*reinterpret_cast<const db::Header *>(base)) {}
+
+  template <typename T> const T *table(const db::Table &t) const { return reinterpret_cast<const T *>(base + t.offset); }
+  template <typename T> bool fits(const db::Table &t, uint64_t extra = 0) const {
+    return t.offset % alignof(T) == 0 && t.offset <= size && (t.count + extra) <= (size - t.offset) / sizeof(T);
+  }
+
+  [[noreturn]] static void corrupt() {
+    std::fprintf(stderr, "Corrupt report: a record refers past the end of a table\n");
+    std::exit(EXIT_FAILURE);
+  }
+  template <typename T> const T &at(const db::Table &t, uint64_t i) const {
+    if (i >= t.count) corrupt();
+    return table<T>(t)[i];
+  }
+  static void within(uint64_t first, uint64_t count, const db::Table &t) {
+    if (first > t.count || count > t.count - first) corrupt();
+  }
+
+  bool valid() const {
+    return size >= sizeof(db::Header) && std::memcmp(header.magic, db::Magic, sizeof(db::Magic)) == 0 && header.version == db::Version &&
+           fits<uint64_t>(header.strings, 1) && fits<char>(header.chars) && fits<db::Function>(header.functions) &&
+           fits<uint32_t>(header.byName) && fits<db::Call>(header.calls) && fits<db::Arg>(header.args) && fits<uint32_t>(header.origins) &&
+           fits<uint32_t>(header.byDepth) && fits<uint32_t>(header.byIndirections) && fits<uint32_t>(header.byNonAllocOrigins) &&
+           header.byName.count == header.functions.count && header.byDepth.count == header.args.count &&
+           header.byIndirections.count == header.args.count && header.byNonAllocOrigins.count == header.args.count;
+  }
+
+  std::string_view string(uint32_t id) const {
+    if (id >= header.strings.count) return "<invalid>";
+    const auto *offsets = table<uint64_t>(header.strings);
+    if (offsets[id] > offsets[id + 1] || offsets[id + 1] > header.chars.count) return "<invalid>";
+    return {table<char>(header.chars) + offsets[id], offsets[id + 1] - offsets[id]};
+  }
+
+  const db::Header &info() const { return header; }
+  // Records are checked as they are read rather than up front, so a query still only touches the pages it needs: an index out of its
+  // table, or a record referring to one, means the file is corrupt.
+  const db::Function &function(uint64_t i) const {
+    const auto &f = at<db::Function>(header.functions, i);
+    within(f.firstCall, f.callCount, header.calls);
+    return f;
+  }
+  const db::Call &call(uint64_t i) const {
+    const auto &c = at<db::Call>(header.calls, i);
+    within(c.function, 1, header.functions);
+    within(c.firstArg, c.argCount, header.args);
+    return c;
+  }
+  const db::Arg &arg(uint64_t i) const {
+    const auto &a = at<db::Arg>(header.args, i);
+    within(a.call, 1, header.calls);
+    within(a.firstOrigin, a.originCount, header.origins);
+    return a;
+  }
+  uint32_t origin(uint64_t i) const { return at<uint32_t>(header.origins, i); }
+
+  // Binary search over the name index.
+  const db::Function *find(std::string_view name) const {
+    const auto *byName = table<uint32_t>(header.byName);
+    const auto *end = byName + header.byName.count;
+    const auto *it = std::lower_bound(byName, end, name, [&](uint32_t f, std::string_view n) { return string(function(f).name) < n; });
+    return it != end && string(function(*it).name) == name ? &function(*it) : nullptr;
+  }
+};
+
+static std::string_view trimmed(std::string_view s) {
+  while (!s.empty() && s.front() == ' ')
+    s.remove_prefix(1);
+  return s;
+}
+
+int main(int argc, char **argv) {
+  if (argc < 2) {
+    std::fprintf(stderr,
+                 "Usage: %s <report.ptdb> [--functions] [--function <name>] [--by depth|indirections|nonalloc] [--top <n>]\n"
+                 "       [--min-depth <n>] [--min-indirections <n>] [--min-nonalloc <n>] [--truncated] [--origins]\n",
+                 argv[0]);
+    return EXIT_FAILURE;
+  }
+  bool listFunctions = false, onlyTruncated = false, origins = false;
+  const char *functionName = nullptr;
+  std::string by;
+  uint64_t top = UINT64_MAX, minDepth = 0, minIndirections = 0, minNonAlloc = 0;
+  for (int i = 2; i < argc; ++i) {
+    const std::string arg = argv[i];
+    auto next = [&]() { return i + 1 < argc ? argv[++i] : ""; };
+    if (arg == "--functions") listFunctions = true;
+    else if (arg == "--function") functionName = next();
+    else if (arg == "--by") by = next();
+    else if (arg == "--top") top = std::strtoull(next(), nullptr, 10);
+    else if (arg == "--min-depth") minDepth = std::strtoull(next(), nullptr, 10);
+    else if (arg == "--min-indirections") minIndirections = std::strtoull(next(), nullptr, 10);
+    else if (arg == "--min-nonalloc") minNonAlloc = std::strtoull(next(), nullptr, 10);
+    else if (arg == "--truncated") onlyTruncated = true;
+    else if (arg == "--origins") origins = true;
+    else {
+      std::fprintf(stderr, "Unknown option %s\n", arg.c_str());
+      return EXIT_FAILURE;
+    }
+  }
+  if (!by.empty() && by != "depth" && by != "indirections" && by != "nonalloc") {
+    std::fprintf(stderr, "--by expects depth, indirections or nonalloc\n");
+    return EXIT_FAILURE;
+  }
+
+  int fd = open(argv[1], O_RDONLY);
+  struct stat st {};
+  if (fd < 0 || fstat(fd, &st) != 0) {
+    std::perror(argv[1]);
+    return EXIT_FAILURE;
+  }
+  const size_t size = static_cast<size_t>(st.st_size);
+  void *mem = size ? mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0) : MAP_FAILED;
+  close(fd);
+  if (mem == MAP_FAILED || size < sizeof(db::Header)) {
+    std::fprintf(stderr, "Unable to map %s\n", argv[1]);
+    return EXIT_FAILURE;
+  }
+  const Report report(static_cast<const char *>(mem), size);
+  if (!report.valid()) {
+    std::fprintf(stderr, "%s is not a ptr-tracer report database (version %u)\n", argv[1], db::Version);
+    return EXIT_FAILURE;
+  }
+  const auto &header = report.info();
+
+  if (listFunctions) {
+    for (uint32_t f = 0; f < header.functions.count && top; ++f) {
+      const auto &fn = report.function(f);
+      if (functionName && report.string(fn.name) != functionName) continue;
+      const auto name = report.string(fn.name);
+      std::printf("%.*s\t%u calls\n", static_cast<int>(name.size()), name.data(), fn.callCount);
+      --top;
+    }
+    return EXIT_SUCCESS;
+  }
+
+  // Candidate arguments: those of one function, or all of them, in the order of the requested table.
+  auto field = [&](const db::Arg &a) -> uint32_t {
+    return by == "depth" ? a.maxDepth : by == "indirections" ? a.indirections : a.nonAllocOrigins;
+  };
+  const uint64_t minField = by == "depth" ? minDepth : by == "indirections" ? minIndirections : minNonAlloc;
+  std::vector<uint32_t> selected;
+  const uint32_t *order = nullptr;
+  uint64_t count = header.args.count;
+  if (functionName) {
+    const auto *fn = report.find(functionName);
+    if (!fn) {
+      std::fprintf(stderr, "No function named %s\n", functionName);
+      return EXIT_FAILURE;
+    }
+    for (uint32_t c = fn->firstCall; c < fn->firstCall + fn->callCount; ++c)
+      for (uint32_t a = report.call(c).firstArg; a < report.call(c).firstArg + report.call(c).argCount; ++a)
+        selected.push_back(a);
+    if (!by.empty())
+      std::stable_sort(selected.begin(), selected.end(), [&](uint32_t l, uint32_t r) { return field(report.arg(l)) > field(report.arg(r)); });
+    order = selected.data();
+    count = selected.size();
+  } else if (!by.empty()) {
+    order = report.table<uint32_t>(by == "depth" ? header.byDepth : by == "indirections" ? header.byIndirections : header.byNonAllocOrigins);
+  }
+
+  for (uint64_t i = 0; i < count && top; ++i) {
+    const uint32_t index = order ? order[i] : static_cast<uint32_t>(i);
+    const auto &a = report.arg(index);
+    if (!by.empty() && field(a) < minField) break; // sorted, nothing further qualifies
+    if (a.maxDepth < minDepth || a.indirections < minIndirections || a.nonAllocOrigins < minNonAlloc || (onlyTruncated && !a.truncated))
+      continue;
+    const auto &c = report.call(a.call);
+    const auto function = report.string(report.function(c.function).name), text = trimmed(report.string(a.text));
+    const auto instruction = trimmed(report.string(c.instruction));
+    std::printf("%.*s\tmaxDepth=%u indirections=%s%u nonAllocOrigins=%u%s\t%.*s\t%.*s\n", static_cast<int>(function.size()),
+                function.data(), a.maxDepth, a.inexact ? ">=" : "", a.indirections, a.nonAllocOrigins, a.truncated ? " truncated" : "",
+                static_cast<int>(text.size()), text.data(), static_cast<int>(instruction.size()), instruction.data());
+    for (uint32_t o = a.firstOrigin; origins && o < a.firstOrigin + a.originCount; ++o) {
+      const auto label = report.string(report.origin(o));
+      std::printf("  origin: %.*s\n", static_cast<int>(label.size()), label.data());
+    }
+    --top;
+  }
+  munmap(mem, size);
+  return EXIT_SUCCESS;
+}
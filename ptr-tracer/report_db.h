@@ -0,0 +1,45 @@
+#pragma once
+
+// Layout of the binary report (PTR_TRACER_FORMAT=db), written by plugin.cpp and read in place by query.cpp.
+// The file is a Header followed by tables of fixed-size records in host byte order, each at an 8-byte aligned offset, so a reader maps it
+// and only touches the pages a query needs. Strings (names, instructions, arguments and origin labels) are interned once.
+
+#include <cstdint>
+
+namespace ptr_tracer::db {
+
+constexpr char Magic[8] = {'P', 'T', 'R', 'T', 'R', 'D', 'B', '\0'};
+constexpr uint32_t Version = 2;
+
+struct Table {
+  uint64_t offset, count; // in bytes from the start of the file, and in records
+};
+
+struct Function {
+  uint32_t name, firstCall, callCount;
+};
+
+struct Call {
+  uint32_t function, instruction, firstArg, argCount;
+};
+
+struct Arg {
+  uint32_t call, text, maxDepth, indirections, nonAllocOrigins, truncated, inexact, firstOrigin, originCount;
+};
+
+struct Header {
+  char magic[8];
+  uint32_t version, module;   // module: string of the module name
+  Table strings;              // uint64_t offsets into chars, count + 1 of them so string i is [offsets[i], offsets[i + 1])
+  Table chars;                // bytes of every string, not NUL-terminated
+  Table functions;            // Function, in module order
+  Table byName;               // uint32_t function indices, sorted by name
+  Table calls;                // Call, grouped by function
+  Table args;                 // Arg, grouped by call
+  Table origins;              // uint32_t strings, grouped by argument
+  Table byDepth;              // uint32_t argument indices, by maxDepth descending
+  Table byIndirections;       // uint32_t argument indices, by indirections descending
+  Table byNonAllocOrigins;    // uint32_t argument indices, by nonAllocOrigins descending
+};
+
+} // namespace ptr_tracer::db
@@ -0,0 +1,202 @@
+// Scaling benchmark: generates synthetic modules of growing size, runs `opt -passes=ptrtracer` over each and prints one JSON object per
+// run with the per-phase timings reported by the plugin (PTR_TRACER_TIMINGS) and the peak RSS of opt, see the `scaling` target.
+// Usage: scaling [--plugin libPtrTracer.so] [--max <n>] [--shapes chain,web,recursive,fanin]
+// Sizes go up by a factor of 10 from 10 to --max (default 10000). Shapes:
+//  - chain:     n functions each calling the next with an offset pointer, and returning a pointer that may be its argument
+//  - web:       one loop with n pointer PHIs, fed back into each other through selects
+//  - recursive: n mutually recursive functions in a single SCC
+//  - fanin:     one pointer parameter reached from n call sites with different origins
+// opt is found on PATH unless $OPT is set.
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#ifdef __APPLE__
+static constexpr const char *PluginName = "libPtrTracer.dylib";
+static constexpr long RssUnit = 1024; // ru_maxrss is in bytes
+#else
+static constexpr const char *PluginName = "libPtrTracer.so";
+static constexpr long RssUnit = 1; // and in KiB elsewhere
+#endif
+
+static constexpr const char *Prelude = "declare ptr @malloc(i64)\n"
+                                       "declare void @use(ptr)\n"
+                                       "@g = global [64 x i8] zeroinitializer\n\n";
+
+static void chain(std::ostream &out, size_t n) {
+  out << "define ptr @c0(ptr %p) noinline {\n"
+         "  %m = call ptr @malloc(i64 16)\n"
+         "  %z = icmp eq ptr %p, null\n"
+         "  %r = select i1 %z, ptr %m, ptr %p\n"
+         "  call void @use(ptr %r)\n"
+         "  ret ptr %r\n"
+         "}\n";
+  for (size_t i = 1; i < n; ++i)
+    out << "define ptr @c" << i << "(ptr %p) noinline {\n"
+        << "  %q = getelementptr i8, ptr %p, i64 1\n"
+        << "  %r = call ptr @c" << i - 1 << "(ptr %q)\n"
+        << "  call void @use(ptr %r)\n"
+        << "  ret ptr %r\n"
+        << "}\n";
+  out << "define void @main() {\n"
+         "  %a = alloca [64 x i8]\n"
+         "  %r = call ptr @c"
+      << n - 1
+      << "(ptr %a)\n"
+         "  call void @use(ptr %r)\n"
+         "  ret void\n"
+         "}\n";
+}
+
+static void web(std::ostream &out, size_t n) {
+  out << "define void @main(i1 %c, i64 %iterations) {\n"
+         "entry:\n"
+         "  %a = alloca [64 x i8]\n"
+         "  %m = call ptr @malloc(i64 64)\n"
+         "  br label %loop\n"
+         "loop:\n"
+         "  %i = phi i64 [ 0, %entry ], [ %next, %loop ]\n";
+  const char *inits[] = {"%a", "%m", "@g"};
+  for (size_t i = 0; i < n; ++i)
+    out << "  %p" << i << " = phi ptr [ " << inits[i % 3] << ", %entry ], [ %s" << i << ", %loop ]\n";
+  for (size_t i = 0; i < n; ++i) {
+    out << "  %s" << i << " = select i1 %c, ptr %p" << (i + 1) % n << ", ptr %p" << (i * 7 + 3) % n << "\n";
+    out << "  call void @use(ptr %p" << i << ")\n";
+  }
+  out << "  %next = add i64 %i, 1\n"
+         "  %done = icmp eq i64 %next, %iterations\n"
+         "  br i1 %done, label %exit, label %loop\n"
+         "exit:\n"
+         "  ret void\n"
+         "}\n";
+}
+
+static void recursive(std::ostream &out, size_t n) {
+  for (size_t i = 0; i < n; ++i)
+    out << "define ptr @r" << i << "(ptr %p, i32 %n) noinline {\n"
+        << "  %z = icmp eq i32 %n, 0\n"
+        << "  %k = sub i32 %n, 1\n"
+        << "  %q = getelementptr i8, ptr %p, i64 1\n"
+        << "  %x = call ptr @r" << (i + 1) % n << "(ptr %q, i32 %k)\n"
+        << "  %y = call ptr @r" << (i * 7 + 3) % n << "(ptr %x, i32 %k)\n"
+        << "  call void @use(ptr %y)\n"
+        << "  %r = select i1 %z, ptr %p, ptr %y\n"
+        << "  ret ptr %r\n"
+        << "}\n";
+  out << "define void @main() {\n"
+         "  %a = alloca [64 x i8]\n"
+         "  %r = call ptr @r0(ptr %a, i32 100)\n"
+         "  call void @use(ptr %r)\n"
+         "  ret void\n"
+         "}\n";
+}
+
+static void fanin(std::ostream &out, size_t n) {
+  out << "define void @sink(ptr %p) noinline {\n"
+         "  call void @use(ptr %p)\n"
+         "  ret void\n"
+         "}\n"
+         "define void @mid(ptr %p) noinline {\n"
+         "  %q = getelementptr i8, ptr %p, i64 8\n"
+         "  call void @sink(ptr %q)\n"
+         "  ret void\n"
+         "}\n"
+         "define void @main() {\n";
+  for (size_t i = 0; i < n; ++i) {
+    switch (i % 3) {
+      case 0: out << "  %o" << i << " = alloca [16 x i8]\n"; break;
+      case 1: out << "  %o" << i << " = call ptr @malloc(i64 16)\n"; break;
+      default: out << "  %o" << i << " = getelementptr i8, ptr @g, i64 " << i % 64 << "\n"; break;
+    }
+    out << "  call void @mid(ptr %o" << i << ")\n";
+  }
+  out << "  ret void\n"
+         "}\n";
+}
+
+static std::string slurp(const std::string &path) {
+  std::ifstream in(path);
+  std::stringstream ss;
+  ss << in.rdbuf();
+  return ss.str();
+}
+
+int main(int argc, char **argv) {
+  std::string plugin, shapes = "chain,web,recursive,fanin";
+  size_t max = 10000;
+  for (int i = 1; i < argc; ++i) {
+    const std::string arg = argv[i];
+    if (arg == "--plugin" && i + 1 < argc) plugin = argv[++i];
+    else if (arg == "--max" && i + 1 < argc) max = std::strtoul(argv[++i], nullptr, 10);
+    else if (arg == "--shapes" && i + 1 < argc) shapes = argv[++i];
+    else {
+      std::fprintf(stderr, "Usage: %s [--plugin %s] [--max <n>] [--shapes chain,web,recursive,fanin]\n", argv[0], PluginName);
+      return EXIT_FAILURE;
+    }
+  }
+  if (plugin.empty()) plugin = std::string("./") + PluginName;
+  const char *opt = std::getenv("OPT");
+  const std::string optPath = opt && *opt ? opt : "opt";
+
+  char dir[] = "/tmp/ptr-tracer-scaling-XXXXXX";
+  if (!mkdtemp(dir)) {
+    std::perror("mkdtemp");
+    return EXIT_FAILURE;
+  }
+  const std::string module = std::string(dir) + "/module.ll", report = std::string(dir) + "/report.yaml",
+                    timings = std::string(dir) + "/timings.json";
+
+  const std::pair<const char *, void (*)(std::ostream &, size_t)> generators[] = {
+      {"chain", chain}, {"web", web}, {"recursive", recursive}, {"fanin", fanin}};
+  bool ok = true;
+  std::printf("[\n");
+  const char *separator = "";
+  for (auto &[shape, generate] : generators) {
+    if (("," + shapes + ",").find(std::string(",") + shape + ",") == std::string::npos) continue;
+    for (size_t n = 10; n <= max; n *= 10) {
+      {
+        std::ofstream out(module);
+        out << Prelude;
+        generate(out, n);
+      }
+      const auto start = std::chrono::steady_clock::now();
+      const pid_t pid = fork();
+      if (pid == 0) {
+        setenv("PTR_TRACER_OUTPUT", report.c_str(), 1);
+        setenv("PTR_TRACER_TIMINGS", timings.c_str(), 1);
+        const std::string load = "-load-pass-plugin=" + plugin;
+        execlp(optPath.c_str(), optPath.c_str(), load.c_str(), "-passes=ptrtracer", "-disable-output", module.c_str(), nullptr);
+        std::perror(optPath.c_str());
+        _exit(127);
+      }
+      int status = 0;
+      rusage usage{};
+      if (pid < 0 || wait4(pid, &status, 0, &usage) < 0 || !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+        std::fprintf(stderr, "opt failed on %s with n = %zu\n", shape, n);
+        ok = false;
+        break;
+      }
+      const double wallMs = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+      // {"shape": ..., "size": ..., "wallMs": ..., "peakRssKiB": ..., "pass": <PTR_TRACER_TIMINGS>}
+      std::printf("%s  {\"shape\": \"%s\", \"size\": %zu, \"wallMs\": %.3f, \"peakRssKiB\": %ld, \"pass\": %s}", separator, shape, n,
+                  wallMs, usage.ru_maxrss / RssUnit, slurp(timings).c_str());
+      std::fflush(stdout);
+      separator = ",\n";
+    }
+  }
+  std::printf("\n]\n");
+  for (auto path : {module, report, timings})
+    std::remove(path.c_str());
+  rmdir(dir);
+  return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,136 @@
+// Runs ptr-tracer outside the link step, e.g. on a build farm.
+// Usage: shard [-j workers] [-o report] [--plugin libPtrTracer.so] <module.bc>...
+// Several bitcode files are merged with llvm-link first. The module is then analysed by `opt -passes=ptrtracer` in worker processes,
+// each reporting one slice of the functions (PTR_TRACER_SHARD), and the slices are concatenated into a report identical to that of a
+// single run. opt and llvm-link are found on PATH unless $OPT or $LLVM_LINK are set; every PTR_TRACER_* knob is passed on to the workers,
+// and PTR_TRACER_JOBS defaults to 1 so workers don't compete for threads.
+
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <sys/wait.h>
+#include <unistd.h>
+
+#ifdef __APPLE__
+static constexpr const char *PluginName = "libPtrTracer.dylib";
+#else
+static constexpr const char *PluginName = "libPtrTracer.so";
+#endif
+
+static std::string tool(const char *variable, const char *fallback) {
+  const char *value = std::getenv(variable);
+  return value && *value ? value : fallback;
+}
+
+// Starts argv[0] with the extra environment variables, -1 if it couldn't be started.
+static pid_t spawn(const std::vector<std::string> &args, const std::vector<std::pair<std::string, std::string>> &env = {}) {
+  const pid_t pid = fork();
+  if (pid != 0) return pid;
+  for (auto &[name, value] : env)
+    setenv(name.c_str(), value.c_str(), 1);
+  std::vector<char *> argv;
+  for (auto &arg : args)
+    argv.push_back(const_cast<char *>(arg.c_str()));
+  argv.push_back(nullptr);
+  execvp(argv[0], argv.data());
+  std::fprintf(stderr, "Unable to run %s: %s\n", argv[0], std::strerror(errno));
+  _exit(127);
+}
+
+static bool succeeded(pid_t pid, const std::string &what) {
+  int status = 0;
+  if (pid < 0 || waitpid(pid, &status, 0) < 0 || !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+    std::fprintf(stderr, "%s failed\n", what.c_str());
+    return false;
+  }
+  return true;
+}
+
+int main(int argc, char **argv) {
+  size_t workers = std::thread::hardware_concurrency();
+  std::string output, plugin;
+  std::vector<std::string> inputs;
+  for (int i = 1; i < argc; ++i) {
+    const std::string arg = argv[i];
+    if (arg == "-j" && i + 1 < argc) workers = std::strtoul(argv[++i], nullptr, 10);
+    else if (arg == "-o" && i + 1 < argc) output = argv[++i];
+    else if (arg == "--plugin" && i + 1 < argc) plugin = argv[++i];
+    else inputs.push_back(arg);
+  }
+  if (inputs.empty() || workers == 0) {
+    std::fprintf(stderr, "Usage: %s [-j workers] [-o report] [--plugin %s] <module.bc>...\n", argv[0], PluginName);
+    return EXIT_FAILURE;
+  }
+  if (plugin.empty()) { // next to this executable
+    const std::string self = argv[0];
+    const auto slash = self.rfind('/');
+    plugin = (slash == std::string::npos ? std::string(".") : self.substr(0, slash)) + "/" + PluginName;
+  }
+  const char *format = std::getenv("PTR_TRACER_FORMAT");
+  const bool jsonl = format && std::string(format) == "jsonl";
+  if (format && std::string(format) == "db") {
+    std::fprintf(stderr, "PTR_TRACER_FORMAT=db reports can't be concatenated, use yaml or jsonl\n");
+    return EXIT_FAILURE;
+  }
+  if (output.empty()) output = inputs.front() + (jsonl ? ".jsonl" : ".yaml");
+
+  const char *tmp = std::getenv("TMPDIR");
+  std::string dir = std::string(tmp && *tmp ? tmp : "/tmp") + "/ptr-tracer-XXXXXX";
+  if (!mkdtemp(dir.data())) {
+    std::perror("mkdtemp");
+    return EXIT_FAILURE;
+  }
+  std::vector<std::string> files; // removed at the end
+  auto cleanup = [&](int code) {
+    for (auto &file : files)
+      std::remove(file.c_str());
+    rmdir(dir.c_str());
+    return code;
+  };
+
+  std::string module = inputs.front();
+  if (inputs.size() > 1) {
+    module = dir + "/merged.bc";
+    files.push_back(module);
+    std::vector<std::string> link{tool("LLVM_LINK", "llvm-link"), "-o", module};
+    link.insert(link.end(), inputs.begin(), inputs.end());
+    if (!succeeded(spawn(link), link.front())) return cleanup(EXIT_FAILURE);
+  }
+
+  const char *jobs = std::getenv("PTR_TRACER_JOBS");
+  std::vector<pid_t> pids;
+  for (size_t k = 0; k < workers; ++k) {
+    files.push_back(dir + "/shard_" + std::to_string(k));
+    pids.push_back(spawn({tool("OPT", "opt"), "-load-pass-plugin=" + plugin, "-passes=ptrtracer", "-disable-output", module},
+                         {{"PTR_TRACER_SHARD", std::to_string(k) + "/" + std::to_string(workers)},
+                          {"PTR_TRACER_OUTPUT", files.back()},
+                          {"PTR_TRACER_JOBS", jobs && *jobs ? jobs : "1"}}));
+  }
+  bool ok = true;
+  for (size_t k = 0; k < workers; ++k)
+    ok &= succeeded(pids[k], "Shard " + std::to_string(k));
+  if (!ok) return cleanup(EXIT_FAILURE);
+
+  // Every shard starts with the module header: three lines of YAML, or the {"module": ...} line of JSON Lines.
+  std::ofstream out(output, std::ios::binary);
+  for (size_t k = 0; k < workers; ++k) {
+    std::ifstream in(dir + "/shard_" + std::to_string(k), std::ios::binary);
+    std::string header;
+    for (int line = 0; k > 0 && line < (jsonl ? 1 : 3); ++line)
+      std::getline(in, header);
+    if (in.peek() != std::ifstream::traits_type::eof()) out << in.rdbuf();
+  }
+  out.close();
+  if (!out) {
+    std::fprintf(stderr, "Unable to write %s\n", output.c_str());
+    return cleanup(EXIT_FAILURE);
+  }
+  std::printf("%s\n", output.c_str());
+  return cleanup(EXIT_SUCCESS);
+}